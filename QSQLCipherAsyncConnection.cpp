@@ -0,0 +1,191 @@
+#include "QSQLCipherAsyncConnection.hpp"
+
+#include "QSQLCipherDriver.hpp"
+
+#include <QFutureWatcher>
+#include <QMutex>
+#include <QPromise>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlRecord>
+
+#include <memory>
+#include <utility>
+
+// Shared between the worker and the thread cancelling futures
+struct QSQLCipherAsyncConnection::State
+{
+    QMutex mutex;
+    QSQLCipherDriver *driver = nullptr; // of the open connection
+    quint64 runningJob = 0;
+};
+
+// The driver must be forgotten before the connection is removed, cancelQuery()
+// may be called on it from another thread.
+static void qRemoveConnection(QMutex *mutex, QSQLCipherDriver **driver, const QString &connectionName)
+{
+    {
+        QMutexLocker locker(mutex);
+        *driver = nullptr;
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+QSQLCipherAsyncConnection::QSQLCipherAsyncConnection(QObject *parent)
+    : QObject(parent), m_state(std::make_shared<State>()), m_context(new QObject), m_connectionName(QStringLiteral("qsqlcipher_async_%1").arg(quintptr(this), 0, 16))
+{
+    m_thread.setObjectName(m_connectionName);
+    m_context->moveToThread(&m_thread);
+    connect(&m_thread, &QThread::finished, m_context, &QObject::deleteLater);
+    m_thread.start();
+}
+
+QSQLCipherAsyncConnection::~QSQLCipherAsyncConnection()
+{
+    // queued behind everything else, QThread::quit() alone would drop pending jobs
+    const QString connectionName = m_connectionName;
+    QMetaObject::invokeMethod(
+        m_context,
+        [state = m_state, connectionName]()
+        {
+            qRemoveConnection(&state->mutex, &state->driver, connectionName);
+            QThread::currentThread()->quit();
+        },
+        Qt::QueuedConnection);
+    m_thread.wait();
+}
+
+template<typename T, typename Job>
+QFuture<T> QSQLCipherAsyncConnection::post(Job &&job)
+{
+    // QPromise is move-only, the queued functor has to be copyable
+    auto promise = std::make_shared<QPromise<T>>();
+    QFuture<T> future = promise->future();
+    promise->start();
+
+    // The job only checks for cancellation between rows, a statement that is
+    // running is interrupted, as long as it is still this job's.
+    const quint64 jobId = ++m_jobSerial;
+    auto watcher = new QFutureWatcher<T>(this);
+    connect(watcher, &QFutureWatcherBase::canceled, this,
+            [state = m_state, jobId]
+            {
+                QMutexLocker locker(&state->mutex);
+                if (state->runningJob == jobId && state->driver)
+                    state->driver->cancelQuery();
+            });
+    connect(watcher, &QFutureWatcherBase::finished, watcher, &QObject::deleteLater);
+    watcher->setFuture(future);
+
+    QMetaObject::invokeMethod(
+        m_context,
+        [state = m_state, jobId, promise, job = std::forward<Job>(job)]() mutable
+        {
+            if (!promise->isCanceled())
+            {
+                {
+                    QMutexLocker locker(&state->mutex);
+                    state->runningJob = jobId;
+                }
+                try
+                {
+                    job(*promise);
+                }
+                catch (const QException &error)
+                {
+                    // QSQLCipherAsyncError among others, cloned with its type
+                    promise->setException(error);
+                }
+                catch (...)
+                {
+                    promise->setException(std::current_exception());
+                }
+                QMutexLocker locker(&state->mutex);
+                state->runningJob = 0;
+            }
+            promise->finish();
+        },
+        Qt::QueuedConnection);
+    return future;
+}
+
+QFuture<void> QSQLCipherAsyncConnection::open(const QString &databaseName, const QString &password, const QString &connectOptions)
+{
+    const QString connectionName = m_connectionName;
+    return post<void>(
+        [state = m_state, connectionName, databaseName, password, connectOptions](QPromise<void> &)
+        {
+            QSqlError error;
+            {
+                QSqlDatabase db;
+                if (QSqlDatabase::contains(connectionName))
+                {
+                    db = QSqlDatabase::database(connectionName, false);
+                }
+                else
+                {
+                    auto driver = new QSQLCipherDriver;
+                    db = QSqlDatabase::addDatabase(driver, connectionName);
+                    QMutexLocker locker(&state->mutex);
+                    state->driver = driver;
+                }
+                db.close();
+                db.setDatabaseName(databaseName);
+                db.setPassword(password);
+                db.setConnectOptions(connectOptions);
+                if (db.open())
+                    return;
+                error = db.lastError();
+            }
+            qRemoveConnection(&state->mutex, &state->driver, connectionName);
+            throw QSQLCipherAsyncError(error);
+        });
+}
+
+QFuture<void> QSQLCipherAsyncConnection::close()
+{
+    const QString connectionName = m_connectionName;
+    return post<void>([state = m_state, connectionName](QPromise<void> &) { qRemoveConnection(&state->mutex, &state->driver, connectionName); });
+}
+
+QFuture<QSQLCipherAsyncConnection::Rows> QSQLCipherAsyncConnection::exec(const QString &query, const QVariantList &boundValues)
+{
+    return execChunked(query, boundValues, 0);
+}
+
+QFuture<QSQLCipherAsyncConnection::Rows> QSQLCipherAsyncConnection::execChunked(const QString &query, const QVariantList &boundValues, int chunkSize)
+{
+    const QString connectionName = m_connectionName;
+    return post<Rows>(
+        [connectionName, query, boundValues, chunkSize](QPromise<Rows> &promise)
+        {
+            QSqlQuery sqlQuery(QSqlDatabase::database(connectionName, false));
+            // forward-only results are read straight from the statement
+            sqlQuery.setForwardOnly(true);
+            if (!sqlQuery.prepare(query))
+                throw QSQLCipherAsyncError(sqlQuery.lastError());
+            for (int i = 0; i < boundValues.size(); ++i)
+                sqlQuery.bindValue(i, boundValues.at(i));
+            if (!sqlQuery.exec())
+                throw QSQLCipherAsyncError(sqlQuery.lastError());
+
+            const int columns = sqlQuery.record().count();
+            Rows rows;
+            while (sqlQuery.next())
+            {
+                if (promise.isCanceled())
+                    return;
+                QVariantList row;
+                row.reserve(columns);
+                for (int i = 0; i < columns; ++i)
+                    row.append(sqlQuery.value(i));
+                rows.append(std::move(row));
+                if (chunkSize > 0 && rows.size() >= chunkSize)
+                    promise.addResult(std::exchange(rows, Rows()));
+            }
+            if (sqlQuery.lastError().isValid())
+                throw QSQLCipherAsyncError(sqlQuery.lastError());
+            if (chunkSize <= 0 || !rows.isEmpty())
+                promise.addResult(std::move(rows));
+        });
+}
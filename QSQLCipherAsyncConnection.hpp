@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QException>
+#include <QFuture>
+#include <QObject>
+#include <QSqlError>
+#include <QThread>
+#include <QVariant>
+
+#include <memory>
+
+// Thrown into the futures of QSQLCipherAsyncConnection when a job fails,
+// QFuture::result() and friends rethrow it.
+class QSQLCipherAsyncError : public QException
+{
+  public:
+    explicit QSQLCipherAsyncError(const QSqlError &error) : m_error(error)
+    {
+    }
+    void raise() const override
+    {
+        throw *this;
+    }
+    QSQLCipherAsyncError *clone() const override
+    {
+        return new QSQLCipherAsyncError(*this);
+    }
+    QSqlError error() const
+    {
+        return m_error;
+    }
+
+  private:
+    QSqlError m_error;
+};
+
+// A QSQLCipherDriver connection confined to its own worker thread.
+//
+// Connections are opened with SQLITE_OPEN_NOMUTEX, so the connection is created,
+// used and closed on the worker only. Every call queues a job and returns at
+// once, jobs run one after another in the order they were queued. Cancelling
+// a future skips its job if it has not started yet and otherwise interrupts
+// its statement with QSQLCipherDriver::cancelQuery(), from the thread this
+// object lives in once its event loop sees the cancellation.
+class QSQLCipherAsyncConnection : public QObject
+{
+    Q_OBJECT
+
+  public:
+    using Rows = QList<QVariantList>;
+
+    explicit QSQLCipherAsyncConnection(QObject *parent = nullptr);
+    // closes the connection after the queued jobs have run
+    ~QSQLCipherAsyncConnection();
+
+    QFuture<void> open(const QString &databaseName, const QString &password, const QString &connectOptions = QString());
+    QFuture<void> close();
+
+    // boundValues bind to the positional placeholders in order; the future
+    // has a single result holding all rows
+    QFuture<Rows> exec(const QString &query, const QVariantList &boundValues = QVariantList());
+    // like exec(), but the future gets one result per batch of chunkSize rows
+    // as soon as the batch is complete, see QFutureWatcher::resultReadyAt()
+    QFuture<Rows> execChunked(const QString &query, const QVariantList &boundValues, int chunkSize);
+
+  private:
+    struct State;
+
+    template<typename T, typename Job>
+    QFuture<T> post(Job &&job);
+
+    std::shared_ptr<State> m_state;
+    quint64 m_jobSerial = 0;
+    QThread m_thread;
+    QObject *m_context; // lives in m_thread, jobs are queued to it
+    const QString m_connectionName;
+};
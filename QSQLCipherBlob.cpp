@@ -0,0 +1,201 @@
+#include "QSQLCipherBlob.hpp"
+
+#include "QSQLCipherDriver.hpp"
+
+#include <utility>
+
+#define SQLITE_HAS_CODEC
+
+#ifdef Q_OS_MAC
+#include <sqlite3.h>
+#else
+#include <sqlcipher/sqlite3.h>
+#endif
+
+QSQLCipherBlob::QSQLCipherBlob(const QSqlDatabase &db, const QString &table, const QString &column, qint64 rowid, QObject *parent)
+    : QIODevice(parent), m_driver(qobject_cast<QSQLCipherDriver *>(db.driver())), m_schema(QStringLiteral("main")), m_table(table), m_column(column),
+      m_rowid(rowid)
+{
+}
+
+QSQLCipherBlob::~QSQLCipherBlob()
+{
+    close();
+}
+
+QVariant QSQLCipherBlob::zeroBlob(qint64 size)
+{
+    return QVariant::fromValue(QSQLCipherZeroBlob{ size });
+}
+
+void QSQLCipherBlob::setSchema(const QString &schema)
+{
+    m_schema = schema;
+}
+
+QString QSQLCipherBlob::schema() const
+{
+    return m_schema;
+}
+
+QString QSQLCipherBlob::table() const
+{
+    return m_table;
+}
+
+QString QSQLCipherBlob::column() const
+{
+    return m_column;
+}
+
+qint64 QSQLCipherBlob::rowId() const
+{
+    return m_rowid;
+}
+
+bool QSQLCipherBlob::open(OpenMode mode)
+{
+    if (isOpen())
+    {
+        qWarning("QSQLCipherBlob::open: device already open");
+        return false;
+    }
+    if (mode & (Append | Truncate | NewOnly))
+    {
+        setErrorString(tr("Append, Truncate and NewOnly are not supported"));
+        return false;
+    }
+    if (!m_driver || !m_driver->isOpen())
+    {
+        setErrorString(tr("Database not open"));
+        return false;
+    }
+
+    const QVariant handle = m_driver->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0)
+    {
+        setErrorString(tr("Database not open"));
+        return false;
+    }
+    sqlite3 *access = *static_cast<sqlite3 *const *>(handle.constData());
+
+    const int res = sqlite3_blob_open(access, m_schema.toUtf8().constData(), m_table.toUtf8().constData(), m_column.toUtf8().constData(), m_rowid,
+                                      (mode & WriteOnly) ? 1 : 0, &m_blob);
+    if (res != SQLITE_OK)
+    {
+        setBlobError(tr("Unable to open blob"), res);
+        // sqlite3_blob_open() may hand out a handle even when it fails
+        sqlite3_blob_close(m_blob);
+        m_blob = nullptr;
+        return false;
+    }
+
+    m_size = sqlite3_blob_bytes(m_blob);
+    m_driver->blobOpened(this);
+    // QIODevice's read buffer would only add a copy of every chunk
+    return QIODevice::open(mode | Unbuffered);
+}
+
+void QSQLCipherBlob::close()
+{
+    if (!m_blob)
+        return;
+
+    QIODevice::close();
+    // the handle is released even if committing the write fails
+    const int res = sqlite3_blob_close(std::exchange(m_blob, nullptr));
+    if (res != SQLITE_OK)
+        setErrorString(tr("Unable to close blob (%1)").arg(res));
+    m_size = 0;
+    if (m_driver)
+        m_driver->blobClosed(this);
+}
+
+bool QSQLCipherBlob::isSequential() const
+{
+    return false;
+}
+
+qint64 QSQLCipherBlob::size() const
+{
+    return m_size;
+}
+
+bool QSQLCipherBlob::seek(qint64 pos)
+{
+    if (pos > m_size)
+        return false;
+    return QIODevice::seek(pos);
+}
+
+bool QSQLCipherBlob::reopen(qint64 rowid)
+{
+    if (!m_blob)
+    {
+        setErrorString(tr("Device not open"));
+        return false;
+    }
+
+    const int res = sqlite3_blob_reopen(m_blob, rowid);
+    if (res != SQLITE_OK)
+    {
+        // the handle is aborted, close it so the device reflects that
+        setBlobError(tr("Unable to reopen blob"), res);
+        close();
+        return false;
+    }
+    m_rowid = rowid;
+    m_size = sqlite3_blob_bytes(m_blob);
+    QIODevice::seek(0);
+    return true;
+}
+
+qint64 QSQLCipherBlob::readData(char *data, qint64 maxSize)
+{
+    if (!m_blob)
+        return -1;
+
+    const qint64 offset = pos();
+    const int length = int(qMin(maxSize, m_size - offset));
+    if (length <= 0)
+        return 0;
+    const int res = sqlite3_blob_read(m_blob, data, length, int(offset));
+    if (res != SQLITE_OK)
+    {
+        setBlobError(tr("Unable to read blob"), res);
+        return -1;
+    }
+    return length;
+}
+
+qint64 QSQLCipherBlob::writeData(const char *data, qint64 maxSize)
+{
+    if (!m_blob)
+        return -1;
+
+    const qint64 offset = pos();
+    if (maxSize > m_size - offset)
+    {
+        setErrorString(tr("Cannot write past the end of the blob, reserve the space with a QSQLCipherZeroBlob"));
+        return -1;
+    }
+    const int res = sqlite3_blob_write(m_blob, data, int(maxSize), int(offset));
+    if (res != SQLITE_OK)
+    {
+        setBlobError(tr("Unable to write blob"), res);
+        return -1;
+    }
+    return maxSize;
+}
+
+void QSQLCipherBlob::setBlobError(const QString &description, int errorCode)
+{
+    QString message;
+    if (m_driver)
+    {
+        const QVariant handle = m_driver->handle();
+        if (handle.isValid() && qstrcmp(handle.typeName(), "sqlite3*") == 0)
+            message = QString::fromUtf8(sqlite3_errmsg(*static_cast<sqlite3 *const *>(handle.constData())));
+    }
+    setErrorString(QStringLiteral("%1: %2 (%3)").arg(description, message).arg(errorCode));
+}
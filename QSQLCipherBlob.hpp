@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QIODevice>
+#include <QPointer>
+#include <QSqlDatabase>
+#include <QVariant>
+
+struct sqlite3_blob;
+class QSQLCipherDriver;
+
+// Binding a QSQLCipherZeroBlob reserves size zero bytes without allocating
+// them, the row can then be filled in chunks through a QSQLCipherBlob.
+struct QSQLCipherZeroBlob
+{
+    qint64 size = 0;
+};
+Q_DECLARE_METATYPE(QSQLCipherZeroBlob)
+
+// Incremental access to a single BLOB value, identified by table, column and
+// rowid, through sqlite3_blob_open(). Reads and writes go straight to the
+// database in whatever chunks the caller uses, so large values never have to
+// be held in memory. Writes cannot change the size of the value, reserve the
+// space with a QSQLCipherZeroBlob first.
+//
+// The device is unbuffered and must be used in the thread of its connection.
+// It is closed when the connection closes.
+class QSQLCipherBlob : public QIODevice
+{
+    Q_OBJECT
+
+  public:
+    explicit QSQLCipherBlob(const QSqlDatabase &db, const QString &table, const QString &column, qint64 rowid, QObject *parent = nullptr);
+    ~QSQLCipherBlob();
+
+    static QVariant zeroBlob(qint64 size);
+
+    // "main" by default, or the name of an attached database
+    void setSchema(const QString &schema);
+    QString schema() const;
+    QString table() const;
+    QString column() const;
+    qint64 rowId() const;
+
+    // Only ReadOnly and ReadWrite (WriteOnly) are supported
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override;
+    qint64 size() const override;
+    bool seek(qint64 pos) override;
+
+    // Moves an open device to another row of the same table and column,
+    // much cheaper than opening a new one
+    bool reopen(qint64 rowid);
+
+  protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+  private:
+    void setBlobError(const QString &description, int errorCode);
+
+    QPointer<QSQLCipherDriver> m_driver;
+    QString m_schema;
+    const QString m_table;
+    const QString m_column;
+    qint64 m_rowid;
+    sqlite3_blob *m_blob = nullptr;
+    qint64 m_size = 0;
+};
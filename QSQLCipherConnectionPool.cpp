@@ -0,0 +1,308 @@
+#include "QSQLCipherConnectionPool.hpp"
+
+#include "QSQLCipherDriver.hpp"
+
+#include <QDeadlineTimer>
+#include <QSqlQuery>
+#include <QThread>
+
+QSQLCipherConnectionPool::QSQLCipherConnectionPool(const QString &databaseName, const QString &password, AccessMode mode, QObject *parent)
+    : QObject(parent), m_databaseName(databaseName), m_password(password), m_mode(mode)
+{
+    m_clock.start();
+}
+
+QSQLCipherConnectionPool::~QSQLCipherConnectionPool()
+{
+    QList<Connection> idle;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_inUse > 0)
+            qWarning("QSQLCipherConnectionPool: destroyed with %d connections still in use.", m_inUse);
+        idle.swap(m_idle);
+    }
+    for (Connection &connection : idle)
+        destroyConnection(connection.db);
+}
+
+QSQLCipherConnectionPool::AccessMode QSQLCipherConnectionPool::accessMode() const
+{
+    return m_mode;
+}
+
+void QSQLCipherConnectionPool::setConnectOptions(const QString &options)
+{
+    QMutexLocker locker(&m_mutex);
+    m_connectOptions = options;
+}
+
+QString QSQLCipherConnectionPool::connectOptions() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_connectOptions;
+}
+
+void QSQLCipherConnectionPool::setMinimumSize(int size)
+{
+    QMutexLocker locker(&m_mutex);
+    m_minimumSize = qMax(0, size);
+}
+
+int QSQLCipherConnectionPool::minimumSize() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_minimumSize;
+}
+
+void QSQLCipherConnectionPool::setMaximumSize(int size)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maximumSize = qMax(1, size);
+}
+
+int QSQLCipherConnectionPool::maximumSize() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_maximumSize;
+}
+
+void QSQLCipherConnectionPool::setIdleTimeout(int msecs)
+{
+    QMutexLocker locker(&m_mutex);
+    m_idleTimeout = msecs;
+}
+
+int QSQLCipherConnectionPool::idleTimeout() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_idleTimeout;
+}
+
+void QSQLCipherConnectionPool::setHealthCheckEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    m_healthCheck = enabled;
+}
+
+bool QSQLCipherConnectionPool::isHealthCheckEnabled() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_healthCheck;
+}
+
+bool QSQLCipherConnectionPool::warmUp()
+{
+    for (;;)
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_idle.size() + m_inUse + m_opening >= m_minimumSize)
+                return true;
+            ++m_opening;
+        }
+
+        QSqlDatabase db = createConnection();
+        if (db.isValid())
+            db.driver()->moveToThread(nullptr);
+
+        QMutexLocker locker(&m_mutex);
+        --m_opening;
+        if (!db.isValid())
+            return false;
+        m_idle.append({ db, m_clock.elapsed() });
+        m_available.wakeOne();
+    }
+}
+
+QSqlDatabase QSQLCipherConnectionPool::acquire(int timeoutMsecs)
+{
+    QElapsedTimer waitTimer;
+    waitTimer.start();
+    const QDeadlineTimer deadline = timeoutMsecs < 0 ? QDeadlineTimer(QDeadlineTimer::Forever) : QDeadlineTimer(timeoutMsecs);
+
+    QMutexLocker locker(&m_mutex);
+    const bool healthCheck = m_healthCheck;
+    QList<Connection> expired = takeExpiredLocked();
+    bool waited = false;
+    QSqlDatabase db;
+    for (;;)
+    {
+        if (!m_idle.isEmpty())
+        {
+            db = m_idle.takeLast().db;
+            ++m_inUse;
+            locker.unlock();
+
+            // parked connections have no thread affinity, pull this one into the caller's thread
+            db.driver()->moveToThread(QThread::currentThread());
+            if (!healthCheck || isHealthy(db))
+                break;
+
+            destroyConnection(db);
+            locker.relock();
+            --m_inUse;
+            ++m_metrics.failedHealthChecks;
+            continue;
+        }
+
+        if (m_idle.size() + m_inUse + m_opening < m_maximumSize)
+        {
+            ++m_opening;
+            locker.unlock();
+            db = createConnection();
+            locker.relock();
+            --m_opening;
+            if (!db.isValid())
+            {
+                m_available.wakeOne();
+                locker.unlock();
+                for (Connection &connection : expired)
+                    destroyConnection(connection.db);
+                return QSqlDatabase();
+            }
+            ++m_inUse;
+            locker.unlock();
+            break;
+        }
+
+        waited = true;
+        if (!m_available.wait(&m_mutex, deadline))
+        {
+            ++m_metrics.timeouts;
+            locker.unlock();
+            for (Connection &connection : expired)
+                destroyConnection(connection.db);
+            return QSqlDatabase();
+        }
+    }
+
+    for (Connection &connection : expired)
+        destroyConnection(connection.db);
+
+    const qint64 waitUsecs = waitTimer.nsecsElapsed() / 1000;
+    locker.relock();
+    ++m_metrics.checkouts;
+    if (waited)
+        ++m_metrics.waits;
+    m_metrics.totalWaitUsecs += waitUsecs;
+    m_metrics.maxWaitUsecs = qMax(m_metrics.maxWaitUsecs, waitUsecs);
+    return db;
+}
+
+void QSQLCipherConnectionPool::release(QSqlDatabase db)
+{
+    if (!db.isValid())
+        return;
+
+    // must be called from the thread the connection was acquired in
+    db.driver()->moveToThread(nullptr);
+
+    QMutexLocker locker(&m_mutex);
+    --m_inUse;
+    if (!db.isOpen() || db.isOpenError())
+    {
+        locker.unlock();
+        destroyConnection(db);
+        locker.relock();
+        m_available.wakeOne();
+        return;
+    }
+    m_idle.append({ db, m_clock.elapsed() });
+    m_available.wakeOne();
+}
+
+int QSQLCipherConnectionPool::evictIdle()
+{
+    QList<Connection> expired;
+    {
+        QMutexLocker locker(&m_mutex);
+        expired = takeExpiredLocked();
+    }
+    for (Connection &connection : expired)
+        destroyConnection(connection.db);
+    return int(expired.size());
+}
+
+QSQLCipherConnectionPool::Metrics QSQLCipherConnectionPool::metrics() const
+{
+    QMutexLocker locker(&m_mutex);
+    Metrics metrics = m_metrics;
+    metrics.idle = int(m_idle.size());
+    metrics.inUse = m_inUse;
+    return metrics;
+}
+
+QSqlError QSQLCipherConnectionPool::lastError() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lastError;
+}
+
+QSqlDatabase QSQLCipherConnectionPool::createConnection()
+{
+    QString options;
+    QString connectionName;
+    {
+        QMutexLocker locker(&m_mutex);
+        options = m_connectOptions;
+        connectionName = QStringLiteral("qsqlcipher_pool_%1_%2").arg(quintptr(this), 0, 16).arg(++m_serial);
+    }
+    options += QStringLiteral(";QSQLCIPHER_KEY_CACHE");
+    // WAL lets the read-only pool keep reading while this pool writes,
+    // it goes first so the caller's options can still override it
+    if (m_mode == ReadOnly)
+        options += QStringLiteral(";QSQLITE_OPEN_READONLY");
+    else
+        options.prepend(QStringLiteral("QSQLITE_JOURNAL_MODE=WAL;"));
+
+    QSqlDatabase db = QSqlDatabase::addDatabase(new QSQLCipherDriver, connectionName);
+    db.setDatabaseName(m_databaseName);
+    db.setPassword(m_password);
+    db.setConnectOptions(options);
+    const bool ok = db.open();
+
+    QMutexLocker locker(&m_mutex);
+    if (!ok)
+    {
+        m_lastError = db.lastError();
+        locker.unlock();
+        destroyConnection(db);
+        return QSqlDatabase();
+    }
+    ++m_metrics.created;
+    return db;
+}
+
+bool QSQLCipherConnectionPool::isHealthy(QSqlDatabase &db)
+{
+    if (!db.isOpen() || db.isOpenError())
+        return false;
+    // cheap round trip that still has to read (and decrypt) the first page
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    return query.exec(QStringLiteral("PRAGMA schema_version"));
+}
+
+QList<QSQLCipherConnectionPool::Connection> QSQLCipherConnectionPool::takeExpiredLocked()
+{
+    QList<Connection> expired;
+    if (m_idleTimeout < 0)
+        return expired;
+
+    const qint64 now = m_clock.elapsed();
+    // the oldest idle connections are at the front
+    while (!m_idle.isEmpty() && m_idle.size() + m_inUse > m_minimumSize && now - m_idle.constFirst().idleSince >= m_idleTimeout)
+    {
+        expired.append(m_idle.takeFirst());
+        ++m_metrics.evicted;
+    }
+    return expired;
+}
+
+void QSQLCipherConnectionPool::destroyConnection(QSqlDatabase &db)
+{
+    const QString connectionName = db.connectionName();
+    // the driver goes away with the last QSqlDatabase referring to it
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QWaitCondition>
+
+// A pool of pre-opened, pre-keyed QSQLCipherDriver connections.
+//
+// Connections are opened with SQLITE_OPEN_NOMUTEX, so a connection must only be
+// used by one thread at a time. acquire() hands a connection to the calling
+// thread and release(), called from that same thread, parks it again without
+// any thread affinity so the next acquire() can pull it into another thread.
+//
+// A ReadWrite pool switches the database to WAL, so a separate ReadOnly pool on
+// the same file can serve readers on all cores while a writer is active.
+// Pools add QSQLCIPHER_KEY_CACHE to the connect options, so growing the pool
+// does not run the key derivation again.
+class QSQLCipherConnectionPool : public QObject
+{
+    Q_OBJECT
+
+  public:
+    enum AccessMode
+    {
+        ReadWrite,
+        ReadOnly
+    };
+
+    struct Metrics
+    {
+        qint64 checkouts = 0;
+        qint64 waits = 0;    // checkouts that found no idle connection and had to wait
+        qint64 timeouts = 0; // checkouts that gave up waiting
+        qint64 totalWaitUsecs = 0;
+        qint64 maxWaitUsecs = 0;
+        qint64 created = 0;
+        qint64 evicted = 0;
+        qint64 failedHealthChecks = 0;
+        int idle = 0;
+        int inUse = 0;
+    };
+
+    explicit QSQLCipherConnectionPool(const QString &databaseName, const QString &password, AccessMode mode = ReadWrite, QObject *parent = nullptr);
+    ~QSQLCipherConnectionPool();
+
+    AccessMode accessMode() const;
+    void setConnectOptions(const QString &options);
+    QString connectOptions() const;
+    void setMinimumSize(int size);
+    int minimumSize() const;
+    void setMaximumSize(int size);
+    int maximumSize() const;
+    // idle connections above the minimum size are closed after this time, -1 keeps them
+    void setIdleTimeout(int msecs);
+    int idleTimeout() const;
+    void setHealthCheckEnabled(bool enabled);
+    bool isHealthCheckEnabled() const;
+
+    // opens connections up to the minimum size
+    bool warmUp();
+    // returns an invalid QSqlDatabase on timeout or if no connection could be opened
+    QSqlDatabase acquire(int timeoutMsecs = -1);
+    void release(QSqlDatabase db);
+    // closes idle connections above the minimum size that timed out, returns how many
+    int evictIdle();
+
+    Metrics metrics() const;
+    QSqlError lastError() const;
+
+  private:
+    struct Connection
+    {
+        QSqlDatabase db;
+        qint64 idleSince = 0;
+    };
+
+    QSqlDatabase createConnection();
+    bool isHealthy(QSqlDatabase &db);
+    QList<Connection> takeExpiredLocked();
+    static void destroyConnection(QSqlDatabase &db);
+
+    const QString m_databaseName;
+    const QString m_password;
+    const AccessMode m_mode;
+    QString m_connectOptions;
+    int m_minimumSize = 1;
+    int m_maximumSize = 8;
+    int m_idleTimeout = 60000;
+    bool m_healthCheck = true;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_available;
+    QList<Connection> m_idle; // most recently released last
+    int m_inUse = 0;
+    int m_opening = 0; // connections being opened outside the lock
+    quint64 m_serial = 0;
+    QElapsedTimer m_clock;
+    Metrics m_metrics;
+    QSqlError m_lastError;
+};
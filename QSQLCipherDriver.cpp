@@ -39,30 +39,57 @@
 
 #include "QSQLCipherDriver.hpp"
 
+#include "QSQLCipherBlob.hpp"
+
+#include <QCache>
+#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QGlobalStatic>
+#include <QHash>
+#include <QMessageAuthenticationCode>
+#include <QMetaMethod>
 #include <QMetaType>
-#include <QScopedValueRollback>
+#include <QMutex>
+#include <QSet>
 #include <QSqlError>
 #include <QSqlField>
 #include <QSqlIndex>
 #include <QSqlQuery>
+#include <QStringEncoder>
 #include <QStringList>
+#include <QThread>
+#include <QTimer>
 #include <QVariant>
+#include <QtEndian>
 #include <QtSql/private/qsqlcachedresult_p.h>
 #include <QtSql/private/qsqldriver_p.h>
 
 #if QT_CONFIG(regularexpression)
-#include <QCache>
 #include <QRegularExpression>
 #endif
 
 #if defined Q_OS_WIN
 #include <qt_windows.h>
 #else
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <vector>
+
 #define SQLITE_HAS_CODEC
 
 #ifdef Q_OS_MAC
@@ -118,6 +145,7 @@ static QSqlError qMakeError(sqlite3 *access, const QString &descr, QSqlError::Er
 }
 
 class QSQLCipherResultPrivate;
+class QSQLCipherSecureBuffer;
 
 class QSQLCipherResult : public QSqlCachedResult
 {
@@ -128,6 +156,7 @@ class QSQLCipherResult : public QSqlCachedResult
     explicit QSQLCipherResult(const QSQLCipherDriver *db);
     ~QSQLCipherResult();
     QVariant handle() const override;
+    int fetchColumns(int maxRows, QList<QSQLCipherColumnBuffer> &columns);
 
   protected:
     bool gotoNext(QSqlCachedResult::ValueCache &row, int idx) override;
@@ -141,6 +170,206 @@ class QSQLCipherResult : public QSqlCachedResult
     QSqlRecord record() const override;
     void detachFromResultSet() override;
     void virtual_hook(int id, void *data) override;
+
+    QVariant data(int i) override;
+    bool isNull(int i) override;
+    bool fetch(int i) override;
+    bool fetchNext() override;
+    bool fetchPrevious() override;
+    bool fetchFirst() override;
+    bool fetchLast() override;
+};
+
+// A prepared statement parked in the per-connection statement cache.
+// The cache owns the statement and finalizes it on eviction.
+struct QSQLCipherCachedStatement
+{
+    explicit QSQLCipherCachedStatement(sqlite3_stmt *statement) : stmt(statement)
+    {
+    }
+    ~QSQLCipherCachedStatement()
+    {
+        sqlite3_finalize(stmt);
+    }
+    Q_DISABLE_COPY_MOVE(QSQLCipherCachedStatement)
+
+    sqlite3_stmt *stmt;
+    // worked out by the results that used the statement before
+    QSqlRecord columns;
+    int columnsReprepared = -1;
+    QList<int> bindPlan;
+    qsizetype bindValueCount = 0;
+};
+
+// Rows of an eager result, see QSQLITE_EAGER_RESULTS. Every cell is a fixed
+// size typed value, text and blob bytes go to an arena of blocks that never
+// move, so the store grows without copying what it already holds.
+class QSQLCipherRowStore
+{
+  public:
+    struct Cell
+    {
+        union
+        {
+            qint64 integer;
+            double real;
+            const char *bytes; // text in the statement's encoding, or blob
+        };
+        int size; // of bytes
+        int type; // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL
+    };
+
+    void clear(int columnCount);
+    void appendRow(sqlite3_stmt *stmt, bool utf8);
+    int rowCount() const
+    {
+        return m_columnCount > 0 ? int(m_cells.size() / m_columnCount) : 0;
+    }
+    const Cell &cell(int row, int column) const
+    {
+        return m_cells.at(qsizetype(row) * m_columnCount + column);
+    }
+
+  private:
+    static constexpr qsizetype BlockSize = 64 * 1024;
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        qsizetype size; // BlockSize, or the size of the one large value it holds
+    };
+    char *allocate(qsizetype size);
+
+    int m_columnCount = 0;
+    QList<Cell> m_cells;
+    std::vector<Block> m_blocks; // the current block is last
+    qsizetype m_blockUsed = BlockSize;
+};
+
+// Keeps the capacity of the cell list and one regular block for the next exec()
+void QSQLCipherRowStore::clear(int columnCount)
+{
+    m_columnCount = columnCount;
+    m_cells.clear();
+    const auto regular = std::find_if(m_blocks.begin(), m_blocks.end(), [](const Block &block) { return block.size == BlockSize; });
+    if (regular == m_blocks.end())
+    {
+        m_blocks.clear();
+        m_blockUsed = BlockSize;
+        return;
+    }
+    Block kept = std::move(*regular);
+    m_blocks.clear();
+    m_blocks.push_back(std::move(kept));
+    m_blockUsed = 0;
+}
+
+char *QSQLCipherRowStore::allocate(qsizetype size)
+{
+    // large values get a block of their own, in front of the current one so
+    // its free space is still used
+    if (size > BlockSize / 4)
+    {
+        if (m_blocks.empty())
+        {
+            m_blocks.push_back({ std::make_unique<char[]>(size), size });
+            m_blockUsed = BlockSize; // full, the next small value starts a new block
+            return m_blocks.back().data.get();
+        }
+        return m_blocks.insert(m_blocks.end() - 1, Block{ std::make_unique<char[]>(size), size })->data.get();
+    }
+    if (BlockSize - m_blockUsed < size)
+    {
+        m_blocks.push_back({ std::make_unique<char[]>(BlockSize), BlockSize });
+        m_blockUsed = 0;
+    }
+    char *bytes = m_blocks.back().data.get() + m_blockUsed;
+    m_blockUsed += size;
+    return bytes;
+}
+
+void QSQLCipherRowStore::appendRow(sqlite3_stmt *stmt, bool utf8)
+{
+    for (int i = 0; i < m_columnCount; ++i)
+    {
+        Cell cell;
+        cell.type = sqlite3_column_type(stmt, i);
+        cell.size = 0;
+        switch (cell.type)
+        {
+            case SQLITE_INTEGER: cell.integer = sqlite3_column_int64(stmt, i); break;
+            case SQLITE_FLOAT: cell.real = sqlite3_column_double(stmt, i); break;
+            case SQLITE_NULL: cell.integer = 0; break;
+            default:
+            {
+                const void *data;
+                if (cell.type == SQLITE_BLOB)
+                {
+                    data = sqlite3_column_blob(stmt, i);
+                    cell.size = sqlite3_column_bytes(stmt, i);
+                }
+                else if (utf8)
+                {
+                    data = sqlite3_column_text(stmt, i);
+                    cell.size = sqlite3_column_bytes(stmt, i);
+                }
+                else
+                {
+                    data = sqlite3_column_text16(stmt, i);
+                    cell.size = sqlite3_column_bytes16(stmt, i);
+                }
+                if (cell.size > 0)
+                {
+                    char *bytes = allocate(cell.size);
+                    memcpy(bytes, data, size_t(cell.size));
+                    cell.bytes = bytes;
+                }
+                else
+                {
+                    cell.bytes = "";
+                }
+                break;
+            }
+        }
+        m_cells.append(cell);
+    }
+}
+
+// SQLite transparently re-prepares a statement when the schema changes under
+// it, which is the only time its result columns can change.
+static int qReprepareCount(sqlite3_stmt *stmt)
+{
+#if (SQLITE_VERSION_NUMBER >= 3020000)
+    return sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+#else
+    Q_UNUSED(stmt);
+    return 0;
+#endif
+}
+
+// Everything record(), primaryIndex(), indexes() and foreignKeys() report for a table
+struct QSQLCipherTableInfo
+{
+    QSqlRecord record;
+    QSqlIndex primaryIndex;
+    QList<QSqlIndex> indexes;
+    QList<QSQLCipherForeignKey> foreignKeys;
+};
+
+// What a query has used of the connection's time and step budgets, kept with
+// the result so interleaved queries do not reset each other's
+struct QSQLCipherQueryBudget
+{
+    QElapsedTimer timer; // restarted for every step()
+    qint64 nsecs = 0;    // spent in the finished step() calls of the query
+    qint64 steps = 0;
+    bool exceeded = false;
+
+    void start()
+    {
+        nsecs = 0;
+        steps = 0;
+        exceeded = false;
+    }
 };
 
 class QSQLCipherDriverPrivate : public QSqlDriverPrivate
@@ -148,14 +377,168 @@ class QSQLCipherDriverPrivate : public QSqlDriverPrivate
     Q_DECLARE_PUBLIC(QSQLCipherDriver)
 
   public:
-    inline QSQLCipherDriverPrivate() : QSqlDriverPrivate(QSqlDriver::SQLite)
+    inline QSQLCipherDriverPrivate() : QSqlDriverPrivate(QSqlDriver::SQLite), statementCache(0)
     {
     }
+    void installHooks();
+    void installTrace();
+    void installProgressHandler();
+    int step(sqlite3_stmt *stmt, QSQLCipherQueryBudget *budget);
+    QSqlError interruptError(const QSQLCipherQueryBudget &budget) const;
+    QSQLCipherCachedStatement *takeStatement(const QString &query);
+    void returnStatement(const QString &query, QSQLCipherCachedStatement *cached);
+    void detectEncoding();
+    void validateCatalog();
+    void clearCatalog();
+    void abortRekey();
+    void settleCommit();
+    void trackSavepoint(sqlite3_stmt *stmt);
+
     sqlite3 *access = nullptr;
+    bool utf8 = false; // database text encoding is UTF-8, use the native UTF-8 API
+    bool encodingKnown = false;
     QList<QSQLCipherResult *> results;
+    QList<QSQLCipherBlob *> blobs;
     QStringList notificationid;
+    // Row changes are collected per table while a transaction runs, staged by
+    // the commit hook and only reported once the commit went through, see
+    // handle_sqlite_callback() and settleCommit()
+    QSet<QByteArray> subscribedTables; // notificationid in UTF-8, checked by the update hook
+    QHash<QByteArray, QSet<qint64>> pendingChanges;
+    QHash<QByteArray, QSet<qint64>> stagedChanges;
+    QHash<QByteArray, QSet<qint64>> committedChanges;
+    bool changeCapture = false;
+    QList<QSQLCipherChange> pendingCapture;
+    QList<QSQLCipherChange> stagedCapture;
+    QList<QSQLCipherChange> committedCapture;
+    // Open savepoints with the size of pendingCapture when each was created,
+    // ROLLBACK TO drops the changes captured after it, see trackSavepoint()
+    QList<QPair<QByteArray, qsizetype>> savepoints;
+    bool commitStaged = false;
+    bool flushScheduled = false;
+    QCache<QString, QSQLCipherCachedStatement> statementCache;
+    QList<QPair<QByteArray, QByteArray>> cipherPragmas; // (pragma, value) from the connect options
+    qint64 statementCacheHits = 0;
+    qint64 statementCacheMisses = 0;
+    // Schema metadata, valid as long as the main and temp schema_version are unchanged
+    QHash<QString, QSQLCipherTableInfo> tableInfo;
+    QHash<int, QStringList> tableLists; // tables() by QSql::TableType
+    sqlite3_stmt *schemaVersionStmt[2] = { nullptr, nullptr };
+    qint64 schemaVersions[2] = { -1, -1 };
+    // Statement tracing, see qTraceCallback()
+    QSQLCipherDriver::TraceOptions traceOptions;
+    int slowQueryThreshold = -1;
+    QHash<QByteArray, QSQLCipherStatementStats> statementStats;
+    QHash<sqlite3_stmt *, qint64> tracedRows;
+    QList<QSQLCipherTraceEvent> pendingTraceEvents;
+    qint64 droppedTraceEvents = 0;
+    std::atomic<bool> traceConnected = false; // statementTraced() has a receiver
+    bool traceFlushScheduled = false;
+    bool explaining = false; // the trace flush is running EXPLAIN QUERY PLAN
+    bool eagerResults = false;
+    // Online rekey, see QSQLCipherDriver::startRekey()
+    QString databaseName; // open() arguments, to open the rekeyed file again
+    QString connectOptions;
+    bool rawKey = false;
+    bool fileDatabase = false; // a plain file name, other connections can open it too
+    bool readOnly = false;
+    sqlite3 *rekeyTarget = nullptr;
+    sqlite3_backup *rekeyBackup = nullptr;
+    QString rekeyFileName;
+    QString rekeyPassword;
+    int rekeyPagesPerStep = -1;
+    // Hot backups open their own connections, with the key this one was opened with
+    std::shared_ptr<QSQLCipherSecureBuffer> keySpec;
+    QThread *backupThread = nullptr;
+    std::atomic<bool> backupAbort = false;
+    // cancelQuery() may come from another thread, access is only cleared under this lock
+    QMutex interruptMutex;
+    // Per statement budgets, enforced by qProgressCallback() while step() runs
+    // a query. Statements the driver runs itself are not budgeted.
+    int queryTimeout = -1;
+    qint64 queryStepLimit = -1;
+    QSQLCipherQueryBudget *runningBudget = nullptr;
 };
 
+// Borrows a prepared statement for the given SQL text from the cache.
+// Returns nullptr on a miss; otherwise the caller owns the entry.
+QSQLCipherCachedStatement *QSQLCipherDriverPrivate::takeStatement(const QString &query)
+{
+    QSQLCipherCachedStatement *cached = statementCache.take(query);
+    if (!cached)
+    {
+        ++statementCacheMisses;
+        return nullptr;
+    }
+
+    ++statementCacheHits;
+    return cached;
+}
+
+// Gives a borrowed statement back to the cache. Bindings are cleared so the
+// cache never keeps pointers into values owned by a finished QSqlResult.
+void QSQLCipherDriverPrivate::returnStatement(const QString &query, QSQLCipherCachedStatement *cached)
+{
+    sqlite3_reset(cached->stmt);
+    sqlite3_clear_bindings(cached->stmt);
+    // QCache deletes (and thereby finalizes) the entry it replaces or evicts
+    statementCache.insert(query, cached);
+}
+
+// PRAGMA schema_version only reads the database header, so checking it on
+// every metadata lookup is much cheaper than loading the catalog again. It
+// also changes when another connection alters the schema.
+void QSQLCipherDriverPrivate::validateCatalog()
+{
+    static const char *const pragmas[] = { "PRAGMA main.schema_version", "PRAGMA temp.schema_version" };
+    bool changed = false;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (!schemaVersionStmt[i] && sqlite3_prepare_v2(access, pragmas[i], -1, &schemaVersionStmt[i], nullptr) != SQLITE_OK)
+        {
+            sqlite3_finalize(std::exchange(schemaVersionStmt[i], nullptr));
+            changed = true;
+            continue;
+        }
+        const qint64 version = sqlite3_step(schemaVersionStmt[i]) == SQLITE_ROW ? sqlite3_column_int64(schemaVersionStmt[i], 0) : -1;
+        sqlite3_reset(schemaVersionStmt[i]);
+        changed |= version < 0 || version != schemaVersions[i];
+        schemaVersions[i] = version;
+    }
+    if (changed)
+    {
+        tableInfo.clear();
+        tableLists.clear();
+    }
+}
+
+void QSQLCipherDriverPrivate::clearCatalog()
+{
+    tableInfo.clear();
+    tableLists.clear();
+    for (int i = 0; i < 2; ++i)
+    {
+        sqlite3_finalize(std::exchange(schemaVersionStmt[i], nullptr));
+        schemaVersions[i] = -1;
+    }
+}
+
+// SQLite converts text to and from the database encoding internally, so
+// talking UTF-8 to a UTF-8 database skips a transcoding step in both directions.
+// PRAGMA encoding loads the schema, so this runs on the first prepare rather
+// than at open time where it would defeat the cheaper key checks.
+void QSQLCipherDriverPrivate::detectEncoding()
+{
+    encodingKnown = true;
+    utf8 = false;
+#if (SQLITE_VERSION_NUMBER >= 3020000)
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(access, "PRAGMA encoding", -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        utf8 = qstrcmp(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), "UTF-8") == 0;
+    sqlite3_finalize(stmt);
+#endif
+}
+
 class QSQLCipherResultPrivate : public QSqlCachedResultPrivate
 {
     Q_DECLARE_PUBLIC(QSQLCipherResult)
@@ -165,24 +548,64 @@ class QSQLCipherResultPrivate : public QSqlCachedResultPrivate
     using QSqlCachedResultPrivate::QSqlCachedResultPrivate;
     void cleanup();
     bool fetchNext(QSqlCachedResult::ValueCache &values, int idx, bool initialFetch);
+    bool step();
+    QVariant columnValue(int i) const;
+    // copies the current row, for when the statement has to move past it
+    void detachRow();
     // initializes the recordInfo and the cache
     void initColumns(bool emptyResultset);
     void finalize();
+    int bindParameter(int index, const QVariant &value);
+    int bindText(int index, const QString &str, bool isStatic);
+    QString columnText(int i) const;
+    QVariant cellValue(int row, int i) const;
+    // steps through the whole result into eagerRows and resets the statement
+    bool materialize();
+    void buildBindPlan();
+    // hands the statement back to the driver's cache, or finalizes it
+    void release();
 
     sqlite3_stmt *stmt = nullptr;
+    QString cacheKey; // SQL text the statement is cached under, empty if not cacheable
+    int rowsAffected = -1; // set by execBatch(), -1 means ask sqlite3_changes()
+    bool utf8 = false;     // statement was prepared with the UTF-8 API
+    QList<QByteArray> boundText; // UTF-8 copies of bound strings, alive until the next bind
+    QList<int> bindPlan;          // parameter i + 1 binds boundValues().at(bindPlan.at(i))
+    qsizetype bindValueCount = 0; // bound values expected when named placeholders are reused
     QSqlRecord rInf;
+    int columnsReprepared = -1;      // qReprepareCount() rInf was built at, -1 if it must be rebuilt
+    bool columnsInitialized = false; // initColumns() ran for the current exec()
     QList<QVariant> firstRow;
     bool skippedStatus = false; // the status of the fetchNext() that's skipped
     bool skipRow = false;       // skip the next fetchNext()?
+    // Forward-only results read straight from the statement instead of the
+    // QSqlCachedResult value cache.
+    bool streaming = false;
+    bool rowPending = false;  // exec() stepped onto the first row, fetchNext() has yet to consume it
+    bool rowDetached = false; // the current row lives in firstRow, the statement is past it
+    // Eager results hold all rows in eagerRows, the statement is reset once exec() returns
+    bool eager = false;
+    QSQLCipherRowStore eagerRows;
+    QSQLCipherQueryBudget budget;
 };
 
 void QSQLCipherResultPrivate::cleanup()
 {
     Q_Q(QSQLCipherResult);
-    finalize();
+    release();
+    boundText.clear();
     rInf.clear();
+    columnsReprepared = -1;
+    columnsInitialized = false;
+    bindPlan.clear();
+    bindValueCount = 0;
     skippedStatus = false;
     skipRow = false;
+    streaming = false;
+    rowPending = false;
+    rowDetached = false;
+    eager = false;
+    eagerRows.clear(0);
     q->setAt(QSql::BeforeFirstRow);
     q->setActive(false);
     q->cleanup();
@@ -195,22 +618,103 @@ void QSQLCipherResultPrivate::finalize()
 
     sqlite3_finalize(stmt);
     stmt = 0;
+    cacheKey.clear();
+}
+
+void QSQLCipherResultPrivate::release()
+{
+    if (!stmt)
+        return;
+
+    auto driverPrivate = const_cast<QSQLCipherDriverPrivate *>(drv_d_func());
+    if (cacheKey.isEmpty() || !driverPrivate)
+    {
+        finalize();
+        return;
+    }
+
+    auto cached = new QSQLCipherCachedStatement(std::exchange(stmt, nullptr));
+    cached->columns = rInf;
+    cached->columnsReprepared = columnsReprepared;
+    cached->bindPlan = std::move(bindPlan);
+    cached->bindValueCount = bindValueCount;
+    driverPrivate->returnStatement(cacheKey, cached);
+    cacheKey.clear();
+}
+
+// QSqlResult stores one value per placeholder occurrence while SQLite has a
+// single parameter per distinct name, so every parameter is mapped to the
+// first value of its name. This only depends on the SQL text and is worked
+// out once per prepared statement instead of on every exec().
+void QSQLCipherResultPrivate::buildBindPlan()
+{
+    const int paramCount = sqlite3_bind_parameter_count(stmt);
+    bindPlan.resize(paramCount);
+    for (int i = 0; i < paramCount; ++i)
+    {
+        int valueIndex = i;
+        if (const char *parameterName = sqlite3_bind_parameter_name(stmt, i + 1))
+        {
+            const auto it = indexes.constFind(QString::fromUtf8(parameterName));
+            if (it != indexes.constEnd() && !it->isEmpty())
+                valueIndex = it->first();
+        }
+        bindPlan[i] = valueIndex;
+    }
+
+    bindValueCount = 0;
+    for (const QList<int> &indexList : qAsConst(indexes))
+        bindValueCount += indexList.size();
 }
 
 void QSQLCipherResultPrivate::initColumns(bool emptyResultset)
 {
     Q_Q(QSQLCipherResult);
+    columnsInitialized = true;
     int nCols = sqlite3_column_count(stmt);
     if (nCols <= 0)
         return;
 
     q->init(nCols);
 
+    // the descriptor outlives exec() and travels with the statement through
+    // the statement cache, it is only rebuilt after a re-prepare. The sqlType
+    // is the storage class of the first row and refreshed on every exec().
+    const int reprepared = qReprepareCount(stmt);
+    if (columnsReprepared == reprepared && rInf.count() == nCols)
+    {
+        for (int i = 0; i < nCols; ++i)
+        {
+            // sqlite3_column_type is documented to have undefined behavior if the result set is empty
+            const int stp = emptyResultset ? -1 : sqlite3_column_type(stmt, i);
+            QSqlField fld = rInf.field(i);
+            if (fld.typeID() == stp)
+                continue;
+            fld.setSqlType(stp);
+            rInf.replace(i, fld);
+        }
+        return;
+    }
+    rInf.clear();
+    // columns without a declared type take theirs from the first row, which
+    // can differ on every exec(), such descriptors are never reused
+    bool typesFromRow = false;
+
     for (int i = 0; i < nCols; ++i)
     {
-        QString colName = QString(reinterpret_cast<const QChar *>(sqlite3_column_name16(stmt, i))).remove(u'"');
-        // must use typeName for resolving the type to match QSQLCipherDriver::record
-        QString typeName = QString(reinterpret_cast<const QChar *>(sqlite3_column_decltype16(stmt, i)));
+        QString colName;
+        QString typeName;
+        if (utf8)
+        {
+            colName = QString::fromUtf8(sqlite3_column_name(stmt, i)).remove(u'"');
+            // must use typeName for resolving the type to match QSQLCipherDriver::record
+            typeName = QString::fromUtf8(sqlite3_column_decltype(stmt, i));
+        }
+        else
+        {
+            colName = QString(reinterpret_cast<const QChar *>(sqlite3_column_name16(stmt, i))).remove(u'"');
+            typeName = QString(reinterpret_cast<const QChar *>(sqlite3_column_decltype16(stmt, i)));
+        }
         // sqlite3_column_type is documented to have undefined behavior if the result set is empty
         int stp = emptyResultset ? -1 : sqlite3_column_type(stmt, i);
 
@@ -222,6 +726,7 @@ void QSQLCipherResultPrivate::initColumns(bool emptyResultset)
         }
         else
         {
+            typesFromRow = true;
             // Get the proper type for the field based on stp value
             switch (stp)
             {
@@ -242,12 +747,11 @@ void QSQLCipherResultPrivate::initColumns(bool emptyResultset)
         fld.setSqlType(stp);
         rInf.append(fld);
     }
+    columnsReprepared = typesFromRow ? -1 : reprepared;
 }
 
 bool QSQLCipherResultPrivate::fetchNext(QSqlCachedResult::ValueCache &values, int idx, bool initialFetch)
 {
-    Q_Q(QSQLCipherResult);
-
     if (skipRow)
     {
         // already fetched
@@ -265,52 +769,47 @@ bool QSQLCipherResultPrivate::fetchNext(QSqlCachedResult::ValueCache &values, in
         firstRow.resize(sqlite3_column_count(stmt));
     }
 
+    if (!step())
+        return false;
+    if (idx < 0 && !initialFetch)
+        return true;
+    for (int i = 0; i < rInf.count(); ++i)
+        values[i + idx] = columnValue(i);
+    return true;
+}
+
+// Advances the statement by one row, returns false at the end or on error.
+bool QSQLCipherResultPrivate::step()
+{
+    Q_Q(QSQLCipherResult);
+
     if (!stmt)
     {
         q->setLastError(QSqlError(QObject::tr("QSQLiteResult", "Unable to fetch row"), QObject::tr("QSQLiteResult", "No query"), QSqlError::ConnectionError));
         q->setAt(QSql::AfterLastRow);
         return false;
     }
-    int res = sqlite3_step(stmt);
+    int res = const_cast<QSQLCipherDriverPrivate *>(drv_d_func())->step(stmt, &budget);
     switch (res)
     {
         case SQLITE_ROW:
             // check to see if should fill out columns
-            if (rInf.isEmpty())
+            if (!columnsInitialized)
                 // must be first call.
                 initColumns(false);
-            if (idx < 0 && !initialFetch)
-                return true;
-            for (int i = 0; i < rInf.count(); ++i)
-            {
-                switch (sqlite3_column_type(stmt, i))
-                {
-                    case SQLITE_BLOB: values[i + idx] = QByteArray(static_cast<const char *>(sqlite3_column_blob(stmt, i)), sqlite3_column_bytes(stmt, i)); break;
-                    case SQLITE_INTEGER: values[i + idx] = sqlite3_column_int64(stmt, i); break;
-                    case SQLITE_FLOAT:
-                        switch (q->numericalPrecisionPolicy())
-                        {
-                            case QSql::LowPrecisionInt32: values[i + idx] = sqlite3_column_int(stmt, i); break;
-                            case QSql::LowPrecisionInt64: values[i + idx] = sqlite3_column_int64(stmt, i); break;
-                            case QSql::LowPrecisionDouble:
-                            case QSql::HighPrecision:
-                            default: values[i + idx] = sqlite3_column_double(stmt, i); break;
-                        };
-                        break;
-                    case SQLITE_NULL: values[i + idx] = QVariant(QMetaType::fromType<QString>()); break;
-                    default:
-                        values[i + idx] = QString(reinterpret_cast<const QChar *>(sqlite3_column_text16(stmt, i)), sqlite3_column_bytes16(stmt, i) / sizeof(QChar));
-                        break;
-                }
-            }
             return true;
         case SQLITE_DONE:
-            if (rInf.isEmpty())
+            if (!columnsInitialized)
                 // must be first call.
                 initColumns(true);
             q->setAt(QSql::AfterLastRow);
             sqlite3_reset(stmt);
             return false;
+        case SQLITE_INTERRUPT:
+            sqlite3_reset(stmt);
+            q->setLastError(drv_d_func()->interruptError(budget));
+            q->setAt(QSql::AfterLastRow);
+            return false;
         case SQLITE_CONSTRAINT:
         case SQLITE_ERROR:
             // SQLITE_ERROR is a generic error code and we must call sqlite3_reset()
@@ -331,6 +830,133 @@ bool QSQLCipherResultPrivate::fetchNext(QSqlCachedResult::ValueCache &values, in
     return false;
 }
 
+QVariant QSQLCipherResultPrivate::columnValue(int i) const
+{
+    Q_Q(const QSQLCipherResult);
+    switch (sqlite3_column_type(stmt, i))
+    {
+        case SQLITE_BLOB: return QByteArray(static_cast<const char *>(sqlite3_column_blob(stmt, i)), sqlite3_column_bytes(stmt, i));
+        case SQLITE_INTEGER: return sqlite3_column_int64(stmt, i);
+        case SQLITE_FLOAT:
+            switch (q->numericalPrecisionPolicy())
+            {
+                case QSql::LowPrecisionInt32: return sqlite3_column_int(stmt, i);
+                case QSql::LowPrecisionInt64: return sqlite3_column_int64(stmt, i);
+                case QSql::LowPrecisionDouble:
+                case QSql::HighPrecision:
+                default: return sqlite3_column_double(stmt, i);
+            };
+        case SQLITE_NULL: return QVariant(QMetaType::fromType<QString>());
+        default: return columnText(i);
+    }
+}
+
+QString QSQLCipherResultPrivate::columnText(int i) const
+{
+    if (utf8)
+        return QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_column_text(stmt, i)), sqlite3_column_bytes(stmt, i));
+    return QString(reinterpret_cast<const QChar *>(sqlite3_column_text16(stmt, i)), sqlite3_column_bytes16(stmt, i) / sizeof(QChar));
+}
+
+QVariant QSQLCipherResultPrivate::cellValue(int row, int i) const
+{
+    Q_Q(const QSQLCipherResult);
+    const QSQLCipherRowStore::Cell &cell = eagerRows.cell(row, i);
+    switch (cell.type)
+    {
+        case SQLITE_BLOB: return QByteArray(cell.bytes, cell.size);
+        case SQLITE_INTEGER: return cell.integer;
+        case SQLITE_FLOAT:
+            switch (q->numericalPrecisionPolicy())
+            {
+                case QSql::LowPrecisionInt32: return int(cell.real);
+                case QSql::LowPrecisionInt64: return qint64(cell.real);
+                case QSql::LowPrecisionDouble:
+                case QSql::HighPrecision:
+                default: return cell.real;
+            };
+        case SQLITE_NULL: return QVariant(QMetaType::fromType<QString>());
+        default:
+            if (utf8)
+                return QString::fromUtf8(cell.bytes, cell.size);
+            return QString(reinterpret_cast<const QChar *>(cell.bytes), cell.size / qsizetype(sizeof(QChar)));
+    }
+}
+
+bool QSQLCipherResultPrivate::materialize()
+{
+    Q_Q(QSQLCipherResult);
+    eagerRows.clear(sqlite3_column_count(stmt));
+    while (step())
+        eagerRows.appendRow(stmt, utf8);
+    // step() has reset the statement, which ends its read transaction
+    if (q->lastError().isValid())
+    {
+        eagerRows.clear(0);
+        return false;
+    }
+    return true;
+}
+
+// Static strings must outlive the statement execution, transient ones are copied.
+int QSQLCipherResultPrivate::bindText(int index, const QString &str, bool isStatic)
+{
+    if (utf8)
+    {
+        boundText.append(str.toUtf8());
+        const QByteArray &text = boundText.constLast();
+        return sqlite3_bind_text(stmt, index, text.constData(), int(text.size()), SQLITE_STATIC);
+    }
+    return sqlite3_bind_text16(stmt, index, str.utf16(), int(str.size()) * sizeof(QChar), isStatic ? SQLITE_STATIC : SQLITE_TRANSIENT);
+}
+
+int QSQLCipherResultPrivate::bindParameter(int index, const QVariant &value)
+{
+    if (value.isNull())
+        return sqlite3_bind_null(stmt, index);
+
+    if (value.metaType() == QMetaType::fromType<QSQLCipherZeroBlob>())
+    {
+#if (SQLITE_VERSION_NUMBER >= 3008011)
+        return sqlite3_bind_zeroblob64(stmt, index, sqlite3_uint64(qMax<qint64>(0, value.value<QSQLCipherZeroBlob>().size)));
+#else
+        return sqlite3_bind_zeroblob(stmt, index, int(qMax<qint64>(0, value.value<QSQLCipherZeroBlob>().size)));
+#endif
+    }
+
+    switch (value.userType())
+    {
+        case QMetaType::QByteArray:
+        {
+            const QByteArray *ba = static_cast<const QByteArray *>(value.constData());
+            return sqlite3_bind_blob(stmt, index, ba->constData(), ba->size(), SQLITE_STATIC);
+        }
+        case QMetaType::Int:
+        case QMetaType::Bool: return sqlite3_bind_int(stmt, index, value.toInt());
+        case QMetaType::Double: return sqlite3_bind_double(stmt, index, value.toDouble());
+        case QMetaType::UInt:
+        case QMetaType::LongLong: return sqlite3_bind_int64(stmt, index, value.toLongLong());
+        case QMetaType::QDateTime:
+        {
+            const QDateTime dateTime = value.toDateTime();
+            return bindText(index, dateTime.toString(Qt::ISODateWithMs), false);
+        }
+        case QMetaType::QTime:
+        {
+            const QTime time = value.toTime();
+            return bindText(index, time.toString(u"hh:mm:ss.zzz"), false);
+        }
+        case QMetaType::QString:
+        {
+            // lifetime of string == lifetime of its qvariant
+            return bindText(index, *static_cast<const QString *>(value.constData()), true);
+        }
+        default:
+            // SQLITE_TRANSIENT makes sure that sqlite buffers the data
+            return bindText(index, value.toString(), false);
+    }
+}
+
 QSQLCipherResult::QSQLCipherResult(const QSQLCipherDriver *db) : QSqlCachedResult(*new QSQLCipherResultPrivate(this, db))
 {
     Q_D(QSQLCipherResult);
@@ -367,14 +993,50 @@ bool QSQLCipherResult::prepare(const QString &query)
 
     setSelect(false);
 
-    const void *pzTail = nullptr;
-    const auto size = int((query.size() + 1) * sizeof(QChar));
+    auto driverPrivate = const_cast<QSQLCipherDriverPrivate *>(d->drv_d_func());
+    const bool cacheable = driverPrivate->statementCache.maxCost() > 0;
+    if (!driverPrivate->encodingKnown)
+        driverPrivate->detectEncoding();
+    d->utf8 = driverPrivate->utf8;
+    if (cacheable)
+    {
+        if (const std::unique_ptr<QSQLCipherCachedStatement> cached{ driverPrivate->takeStatement(query) })
+        {
+            d->stmt = std::exchange(cached->stmt, nullptr);
+            d->rInf = cached->columns;
+            d->columnsReprepared = cached->columnsReprepared;
+            d->bindPlan = std::move(cached->bindPlan);
+            d->bindValueCount = cached->bindValueCount;
+            d->cacheKey = query;
+            return true;
+        }
+    }
+
+    int res;
+    bool hasTail;
+#if (SQLITE_VERSION_NUMBER >= 3020000)
+    if (d->utf8)
+    {
+        const QByteArray utf8Query = query.toUtf8();
+        const char *pzTail = nullptr;
+        // cached statements live long, let SQLite allocate them outside the lookaside pool
+        const unsigned int prepFlags = cacheable ? SQLITE_PREPARE_PERSISTENT : 0;
+        res = sqlite3_prepare_v3(driverPrivate->access, utf8Query.constData(), int(utf8Query.size() + 1), prepFlags, &d->stmt, &pzTail);
+        hasTail = pzTail && !QByteArray(pzTail).trimmed().isEmpty();
+    }
+    else
+#endif
+    {
+        const void *pzTail = nullptr;
+        const auto size = int((query.size() + 1) * sizeof(QChar));
 
 #if (SQLITE_VERSION_NUMBER >= 3003011)
-    int res = sqlite3_prepare16_v2(d->drv_d_func()->access, query.constData(), size, &d->stmt, &pzTail);
+        res = sqlite3_prepare16_v2(driverPrivate->access, query.constData(), size, &d->stmt, &pzTail);
 #else
-    int res = sqlite3_prepare16(d->access, query.constData(), size, &d->stmt, &pzTail);
+        res = sqlite3_prepare16(driverPrivate->access, query.constData(), size, &d->stmt, &pzTail);
 #endif
+        hasTail = pzTail && !QString(reinterpret_cast<const QChar *>(pzTail)).trimmed().isEmpty();
+    }
 
     if (res != SQLITE_OK)
     {
@@ -382,170 +1044,198 @@ bool QSQLCipherResult::prepare(const QString &query)
         d->finalize();
         return false;
     }
-    else if (pzTail && !QString(reinterpret_cast<const QChar *>(pzTail)).trimmed().isEmpty())
+    else if (hasTail)
     {
         setLastError(qMakeError(d->drv_d_func()->access, QObject::tr("QSQLiteResult", "Unable to execute multiple statements at a time"), QSqlError::StatementError,
                                 SQLITE_MISUSE));
         d->finalize();
         return false;
     }
+    d->buildBindPlan();
+    if (cacheable)
+        d->cacheKey = query;
     return true;
 }
 
 bool QSQLCipherResult::execBatch(bool arrayBind)
 {
     Q_UNUSED(arrayBind);
-    Q_D(QSqlResult);
-    QScopedValueRollback<QList<QVariant>> valuesScope(d->values);
-    QList<QVariant> values = d->values;
-    if (values.count() == 0)
-        return false;
-
-    for (int i = 0; i < values.at(0).toList().count(); ++i)
-    {
-        d->values.clear();
-        QScopedValueRollback<QHash<QString, QList<int>>> indexesScope(d->indexes);
-        auto it = d->indexes.constBegin();
-        while (it != d->indexes.constEnd())
-        {
-            bindValue(it.key(), values.at(it.value().first()).toList().at(i), QSql::In);
-            ++it;
-        }
-        if (!exec())
-            return false;
-    }
-    return true;
-}
-
-bool QSQLCipherResult::exec()
-{
     Q_D(QSQLCipherResult);
-    QList<QVariant> values = boundValues();
+    const QList<QVariant> values = boundValues();
+    if (values.isEmpty() || !d->stmt)
+        return false;
 
     d->skippedStatus = false;
     d->skipRow = false;
-    d->rInf.clear();
+    d->rowsAffected = -1;
+    d->columnsInitialized = false;
     clearValues();
     setLastError(QSqlError());
+    setSelect(false);
+    setActive(false);
 
+    sqlite3 *access = d->drv_d_func()->access;
     int res = sqlite3_reset(d->stmt);
     if (res != SQLITE_OK)
     {
-        setLastError(qMakeError(d->drv_d_func()->access, QObject::tr("QSQLiteResult", "Unable to reset statement"), QSqlError::StatementError, res));
+        setLastError(qMakeError(access, QObject::tr("QSQLiteResult", "Unable to reset statement"), QSqlError::StatementError, res));
         d->finalize();
         return false;
     }
 
-    int paramCount = sqlite3_bind_parameter_count(d->stmt);
-    bool paramCountIsValid = paramCount == values.count();
-
-#if (SQLITE_VERSION_NUMBER >= 3003011)
-    // In the case of the reuse of a named placeholder
-    // We need to check explicitly that paramCount is greater than or equal to 1, as sqlite
-    // can end up in a case where for virtual tables it returns 0 even though it
-    // has parameters
-    if (paramCount >= 1 && paramCount < values.count())
+    // named placeholders that are used several times share a single parameter
+    const int paramCount = int(d->bindPlan.size());
+    QList<QVariantList> columns;
+    columns.reserve(paramCount);
+    for (int i = 0; i < paramCount; ++i)
     {
-        const auto countIndexes = [](int counter, const QList<int> &indexList) { return counter + indexList.length(); };
+        const int valueIndex = d->bindPlan.at(i);
+        if (valueIndex >= values.count())
+        {
+            setLastError(QSqlError(QObject::tr("QSQLiteResult", "Parameter count mismatch"), QString(), QSqlError::StatementError));
+            return false;
+        }
+        columns.append(values.at(valueIndex).toList());
+    }
 
-        const int bindParamCount = std::accumulate(d->indexes.cbegin(), d->indexes.cend(), 0, countIndexes);
+    const qsizetype rowCount = columns.isEmpty() ? values.at(0).toList().count() : columns.at(0).count();
+    for (const QVariantList &column : qAsConst(columns))
+    {
+        if (column.count() != rowCount)
+        {
+            setLastError(QSqlError(QObject::tr("QSQLiteResult", "Parameter count mismatch"), QString(), QSqlError::StatementError));
+            return false;
+        }
+    }
 
-        paramCountIsValid = bindParamCount == values.count();
-        // When using named placeholders, it will reuse the index for duplicated
-        // placeholders. So we need to ensure the QList has only one instance of
-        // each value as SQLite will do the rest for us.
-        QList<QVariant> prunedValues;
-        QList<int> handledIndexes;
-        for (int i = 0, currentIndex = 0; i < values.size(); ++i)
+    // Without an open transaction every row would be its own implicit
+    // transaction, so wrap the whole batch in a savepoint.
+    const bool ownTransaction = sqlite3_get_autocommit(access);
+    if (ownTransaction)
+    {
+        res = sqlite3_exec(access, "SAVEPOINT qsqlcipher_batch", nullptr, nullptr, nullptr);
+        if (res != SQLITE_OK)
         {
-            if (handledIndexes.contains(i))
-                continue;
-            const char *parameterName = sqlite3_bind_parameter_name(d->stmt, currentIndex + 1);
-            if (!parameterName)
-            {
-                paramCountIsValid = false;
-                continue;
-            }
-            const auto placeHolder = QString::fromUtf8(parameterName);
-            const auto &indexes = d->indexes.value(placeHolder);
-            handledIndexes << indexes;
-            prunedValues << values.at(indexes.first());
-            ++currentIndex;
+            setLastError(qMakeError(access, QObject::tr("QSQLiteResult", "Unable to begin batch"), QSqlError::TransactionError, res));
+            return false;
         }
-        values = prunedValues;
     }
-#endif
 
-    if (paramCountIsValid)
+    const int totalChangesBefore = sqlite3_total_changes(access);
+    auto driverPrivate = const_cast<QSQLCipherDriverPrivate *>(d->drv_d_func());
+    d->budget.start();
+    for (qsizetype row = 0; row < rowCount; ++row)
     {
-        for (int i = 0; i < paramCount; ++i)
+        d->boundText.clear();
+        for (int i = 0; i < paramCount && res == SQLITE_OK; ++i)
+            res = d->bindParameter(i + 1, columns.at(i).at(row));
+        if (res != SQLITE_OK)
         {
-            res = SQLITE_OK;
-            const QVariant &value = values.at(i);
+            setLastError(qMakeError(access, QObject::tr("QSQLiteResult", "Unable to bind parameters"), QSqlError::StatementError, res));
+            break;
+        }
 
-            if (value.isNull())
-            {
-                res = sqlite3_bind_null(d->stmt, i + 1);
-            }
-            else
-            {
-                switch (value.userType())
-                {
-                    case QMetaType::QByteArray:
-                    {
-                        const QByteArray *ba = static_cast<const QByteArray *>(value.constData());
-                        res = sqlite3_bind_blob(d->stmt, i + 1, ba->constData(), ba->size(), SQLITE_STATIC);
-                        break;
-                    }
-                    case QMetaType::Int:
-                    case QMetaType::Bool: res = sqlite3_bind_int(d->stmt, i + 1, value.toInt()); break;
-                    case QMetaType::Double: res = sqlite3_bind_double(d->stmt, i + 1, value.toDouble()); break;
-                    case QMetaType::UInt:
-                    case QMetaType::LongLong: res = sqlite3_bind_int64(d->stmt, i + 1, value.toLongLong()); break;
-                    case QMetaType::QDateTime:
-                    {
-                        const QDateTime dateTime = value.toDateTime();
-                        const QString str = dateTime.toString(Qt::ISODateWithMs);
-                        res = sqlite3_bind_text16(d->stmt, i + 1, str.utf16(), int(str.size() * sizeof(ushort)), SQLITE_TRANSIENT);
-                        break;
-                    }
-                    case QMetaType::QTime:
-                    {
-                        const QTime time = value.toTime();
-                        const QString str = time.toString(u"hh:mm:ss.zzz");
-                        res = sqlite3_bind_text16(d->stmt, i + 1, str.utf16(), int(str.size() * sizeof(ushort)), SQLITE_TRANSIENT);
-                        break;
-                    }
-                    case QMetaType::QString:
-                    {
-                        // lifetime of string == lifetime of its qvariant
-                        const QString *str = static_cast<const QString *>(value.constData());
-                        res = sqlite3_bind_text16(d->stmt, i + 1, str->unicode(), int(str->size()) * sizeof(QChar), SQLITE_STATIC);
-                        break;
-                    }
-                    default:
-                    {
-                        QString str = value.toString();
-                        // SQLITE_TRANSIENT makes sure that sqlite buffers the data
-                        res = sqlite3_bind_text16(d->stmt, i + 1, str.utf16(), int(str.size()) * sizeof(QChar), SQLITE_TRANSIENT);
-                        break;
-                    }
-                }
-            }
-            if (res != SQLITE_OK)
-            {
-                setLastError(qMakeError(d->drv_d_func()->access, QObject::tr("QSQLiteResult", "Unable to bind parameters"), QSqlError::StatementError, res));
-                d->finalize();
-                return false;
-            }
+        do
+            res = driverPrivate->step(d->stmt, &d->budget);
+        while (res == SQLITE_ROW);
+
+        // sqlite3_reset() reports the specific error of a failed step
+        const int resetRes = sqlite3_reset(d->stmt);
+        if (res == SQLITE_INTERRUPT)
+        {
+            setLastError(d->drv_d_func()->interruptError(d->budget));
+            break;
+        }
+        if (res != SQLITE_DONE)
+        {
+            setLastError(qMakeError(access, QObject::tr("QSQLiteResult", "Unable to execute batch"), QSqlError::StatementError, resetRes));
+            break;
         }
+        res = SQLITE_OK;
     }
-    else
+    const bool ok = !lastError().isValid();
+    d->rowsAffected = sqlite3_total_changes(access) - totalChangesBefore;
+
+    // the bound values only live as long as this function
+    sqlite3_clear_bindings(d->stmt);
+    d->boundText.clear();
+
+    if (ownTransaction)
+    {
+        // The savepoint opened the transaction, ROLLBACK TO and RELEASE would
+        // commit it and report the rolled back rows.
+        res = sqlite3_exec(access, ok ? "RELEASE qsqlcipher_batch" : "ROLLBACK", nullptr, nullptr, nullptr);
+        driverPrivate->settleCommit();
+        if (ok && res != SQLITE_OK)
+        {
+            setLastError(qMakeError(access, QObject::tr("QSQLiteResult", "Unable to commit batch"), QSqlError::TransactionError, res));
+            // do not leave the batch's transaction open behind the caller
+            sqlite3_exec(access, "ROLLBACK", nullptr, nullptr, nullptr);
+            return false;
+        }
+    }
+
+    if (!ok)
+        return false;
+
+    setActive(true);
+    return true;
+}
+
+bool QSQLCipherResult::exec()
+{
+    Q_D(QSQLCipherResult);
+    const QList<QVariant> values = boundValues();
+
+    d->skippedStatus = false;
+    d->skipRow = false;
+    d->rowsAffected = -1;
+    d->columnsInitialized = false;
+    clearValues();
+    setLastError(QSqlError());
+
+    int res = sqlite3_reset(d->stmt);
+    if (res != SQLITE_OK)
+    {
+        setLastError(qMakeError(d->drv_d_func()->access, QObject::tr("QSQLiteResult", "Unable to reset statement"), QSqlError::StatementError, res));
+        d->finalize();
+        return false;
+    }
+
+    d->boundText.clear();
+    const int paramCount = int(d->bindPlan.size());
+    // In the case of the reuse of a named placeholder there are more values
+    // than parameters. We need to check explicitly that paramCount is
+    // greater than or equal to 1, as sqlite can end up in a case where for
+    // virtual tables it returns 0 even though it has parameters
+    const bool paramCountIsValid = paramCount == values.count() || (paramCount >= 1 && paramCount < values.count() && d->bindValueCount == values.count());
+    if (!paramCountIsValid)
     {
         setLastError(QSqlError(QObject::tr("QSQLiteResult", "Parameter count mismatch"), QString(), QSqlError::StatementError));
         return false;
     }
-    d->skippedStatus = d->fetchNext(d->firstRow, 0, true);
+    for (int i = 0; i < paramCount; ++i)
+    {
+        const int valueIndex = d->bindPlan.at(i);
+        res = valueIndex < values.count() ? d->bindParameter(i + 1, values.at(valueIndex)) : SQLITE_RANGE;
+        if (res != SQLITE_OK)
+        {
+            setLastError(qMakeError(d->drv_d_func()->access, QObject::tr("QSQLiteResult", "Unable to bind parameters"), QSqlError::StatementError, res));
+            d->finalize();
+            return false;
+        }
+    }
+    d->budget.start();
+    d->eager = d->drv_d_func()->eagerResults;
+    d->streaming = !d->eager && isForwardOnly();
+    d->rowPending = false;
+    d->rowDetached = false;
+    if (d->eager)
+        d->materialize();
+    else if (d->streaming)
+        d->rowPending = d->step();
+    else
+        d->skippedStatus = d->fetchNext(d->firstRow, 0, true);
     if (lastError().isValid())
     {
         setSelect(false);
@@ -557,6 +1247,155 @@ bool QSQLCipherResult::exec()
     return true;
 }
 
+void QSQLCipherResultPrivate::detachRow()
+{
+    firstRow.resize(rInf.count());
+    for (int i = 0; i < rInf.count(); ++i)
+        firstRow[i] = columnValue(i);
+    rowDetached = true;
+}
+
+QVariant QSQLCipherResult::data(int i)
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+        return i < 0 || i >= d->rInf.count() || at() < 0 ? QVariant() : d->cellValue(at(), i);
+    if (!d->streaming)
+        return QSqlCachedResult::data(i);
+    if (i < 0 || i >= d->rInf.count() || at() < 0)
+        return QVariant();
+    return d->rowDetached ? d->firstRow.at(i) : d->columnValue(i);
+}
+
+bool QSQLCipherResult::isNull(int i)
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+        return i < 0 || i >= d->rInf.count() || at() < 0 || d->eagerRows.cell(at(), i).type == SQLITE_NULL;
+    if (!d->streaming)
+        return QSqlCachedResult::isNull(i);
+    if (i < 0 || i >= d->rInf.count() || at() < 0)
+        return true;
+    return d->rowDetached ? d->firstRow.at(i).isNull() : sqlite3_column_type(d->stmt, i) == SQLITE_NULL;
+}
+
+bool QSQLCipherResult::fetchNext()
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+    {
+        if (at() == QSql::AfterLastRow)
+            return false;
+        if (!fetch(at() + 1))
+        {
+            setAt(QSql::AfterLastRow);
+            return false;
+        }
+        return true;
+    }
+    if (!d->streaming)
+        return QSqlCachedResult::fetchNext();
+    if (d->rowDetached)
+        setAt(QSql::AfterLastRow);
+    if (at() == QSql::AfterLastRow)
+        return false;
+
+    if (d->rowPending)
+        d->rowPending = false;
+    else if (!d->step())
+        return false;
+    setAt(at() + 1);
+    return true;
+}
+
+bool QSQLCipherResult::fetch(int i)
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+    {
+        if (i < 0 || i >= d->eagerRows.rowCount())
+            return false;
+        setAt(i);
+        return true;
+    }
+    if (!d->streaming)
+        return QSqlCachedResult::fetch(i);
+    if (i < 0 || i < at())
+        return false;
+    while (at() < i)
+    {
+        if (!fetchNext())
+            return false;
+    }
+    return true;
+}
+
+bool QSQLCipherResult::fetchPrevious()
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+    {
+        if (at() <= 0)
+        {
+            setAt(QSql::BeforeFirstRow);
+            return false;
+        }
+        return fetch(at() - 1);
+    }
+    if (!d->streaming)
+        return QSqlCachedResult::fetchPrevious();
+    return false;
+}
+
+bool QSQLCipherResult::fetchFirst()
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+        return fetch(0);
+    if (!d->streaming)
+        return QSqlCachedResult::fetchFirst();
+    if (at() == 0)
+        return true;
+    return at() == QSql::BeforeFirstRow && fetchNext();
+}
+
+bool QSQLCipherResult::fetchLast()
+{
+    Q_D(QSQLCipherResult);
+    if (d->eager)
+        return fetch(d->eagerRows.rowCount() - 1);
+    if (!d->streaming)
+        return QSqlCachedResult::fetchLast();
+    if (d->rowDetached)
+        return true;
+    if (at() == QSql::AfterLastRow)
+        return false;
+
+    // SQLite resets the statement once it steps past the last row, so every
+    // row is copied before moving on in case it turns out to be the last one.
+    int row = at();
+    if (row >= 0)
+        d->detachRow();
+    if (d->rowPending)
+    {
+        d->rowPending = false;
+        ++row;
+        d->detachRow();
+    }
+    while (d->step())
+    {
+        ++row;
+        d->detachRow();
+    }
+    if (row < 0 || lastError().isValid())
+    {
+        d->rowDetached = false;
+        return false;
+    }
+    setAt(row);
+    return true;
+}
+
 bool QSQLCipherResult::gotoNext(QSqlCachedResult::ValueCache &row, int idx)
 {
     Q_D(QSQLCipherResult);
@@ -565,12 +1404,17 @@ bool QSQLCipherResult::gotoNext(QSqlCachedResult::ValueCache &row, int idx)
 
 int QSQLCipherResult::size()
 {
+    Q_D(const QSQLCipherResult);
+    if (d->eager && isSelect())
+        return d->eagerRows.rowCount();
     return -1;
 }
 
 int QSQLCipherResult::numRowsAffected()
 {
     Q_D(const QSQLCipherResult);
+    if (d->rowsAffected >= 0)
+        return d->rowsAffected;
     return sqlite3_changes(d->drv_d_func()->access);
 }
 
@@ -599,6 +1443,8 @@ void QSQLCipherResult::detachFromResultSet()
     Q_D(QSQLCipherResult);
     if (d->stmt)
         sqlite3_reset(d->stmt);
+    d->rowPending = false;
+    d->rowDetached = false;
 }
 
 QVariant QSQLCipherResult::handle() const
@@ -607,9 +1453,138 @@ QVariant QSQLCipherResult::handle() const
     return QVariant::fromValue(d->stmt);
 }
 
+static QSQLCipherColumnBuffer::Kind qColumnKind(const QSqlField &field)
+{
+    switch (field.metaType().id())
+    {
+        case QMetaType::Int:
+        case QMetaType::LongLong:
+        case QMetaType::Bool: return QSQLCipherColumnBuffer::Integer;
+        case QMetaType::Double: return QSQLCipherColumnBuffer::Real;
+        case QMetaType::QByteArray: return QSQLCipherColumnBuffer::Blob;
+        default: return QSQLCipherColumnBuffer::Text;
+    }
+}
+
+// Reads rows straight from the statement into the column buffers, skipping
+// the QVariant per cell that data() has to produce.
+int QSQLCipherResult::fetchColumns(int maxRows, QList<QSQLCipherColumnBuffer> &columns)
+{
+    Q_D(QSQLCipherResult);
+    if (!d->streaming || !isActive() || !isSelect())
+        return -1;
+
+    const int nCols = d->rInf.count();
+    columns.resize(nCols);
+    for (int i = 0; i < nCols; ++i)
+    {
+        QSQLCipherColumnBuffer &column = columns[i];
+        column.kind = qColumnKind(d->rInf.field(i));
+        // QByteArray::clear() would free the storage, the lists keep theirs
+        column.nulls.resize(0);
+        column.integers.clear();
+        column.reals.clear();
+        column.offsets.clear();
+        column.data.resize(0);
+        if (column.kind == QSQLCipherColumnBuffer::Text || column.kind == QSQLCipherColumnBuffer::Blob)
+            column.offsets.append(0);
+    }
+
+    int rows = 0;
+    while (rows < maxRows && fetchNext())
+    {
+        if (rows % 8 == 0)
+        {
+            for (QSQLCipherColumnBuffer &column : columns)
+                column.nulls.append('\0');
+        }
+        for (int i = 0; i < nCols; ++i)
+        {
+            QSQLCipherColumnBuffer &column = columns[i];
+            const bool null = sqlite3_column_type(d->stmt, i) == SQLITE_NULL;
+            if (null)
+                column.nulls[rows / 8] |= char(1 << (rows % 8));
+
+            switch (column.kind)
+            {
+                case QSQLCipherColumnBuffer::Integer: column.integers.append(null ? 0 : sqlite3_column_int64(d->stmt, i)); break;
+                case QSQLCipherColumnBuffer::Real: column.reals.append(null ? 0.0 : sqlite3_column_double(d->stmt, i)); break;
+                case QSQLCipherColumnBuffer::Text:
+                    if (!null)
+                        column.data.append(reinterpret_cast<const char *>(sqlite3_column_text(d->stmt, i)), sqlite3_column_bytes(d->stmt, i));
+                    column.offsets.append(column.data.size());
+                    break;
+                case QSQLCipherColumnBuffer::Blob:
+                    if (!null)
+                        column.data.append(static_cast<const char *>(sqlite3_column_blob(d->stmt, i)), sqlite3_column_bytes(d->stmt, i));
+                    column.offsets.append(column.data.size());
+                    break;
+            }
+        }
+        ++rows;
+    }
+    return lastError().isValid() ? -1 : rows;
+}
+
 /////////////////////////////////////////////////////////
 
 #if QT_CONFIG(regularexpression)
+// Text arguments are taken as UTF-16, which is what QRegularExpression works
+// on, the functions are registered with SQLITE_UTF16 so SQLite hands the
+// values over without converting them when the database is UTF-16 too.
+static QStringView qTextArgument(sqlite3_value *value)
+{
+    const auto text = static_cast<const QChar *>(sqlite3_value_text16(value));
+    return QStringView(text, sqlite3_value_bytes16(value) / qsizetype(sizeof(QChar)));
+}
+
+static void qResultText(sqlite3_context *context, QStringView text)
+{
+    sqlite3_result_text16(context, text.utf16(), int(text.size() * sizeof(QChar)), SQLITE_TRANSIENT);
+}
+
+// The compiled pattern of a constant argument is kept as auxiliary data on
+// the statement, so it is looked up once per statement instead of once per
+// row. The cache covers patterns that change from row to row.
+static QRegularExpression qRegexpArgument(sqlite3_context *context, sqlite3_value **argv, int arg, QRegularExpression::PatternOptions options,
+                                          bool *fromAuxdata)
+{
+    if (auto regexp = static_cast<const QRegularExpression *>(sqlite3_get_auxdata(context, arg)))
+    {
+        *fromAuxdata = true;
+        return *regexp;
+    }
+    *fromAuxdata = false;
+
+    const QString pattern = qTextArgument(argv[arg]).toString();
+    auto cache = static_cast<QCache<QString, QRegularExpression> *>(sqlite3_user_data(context));
+    if (const QRegularExpression *cached = cache->object(pattern))
+        return *cached;
+
+    QRegularExpression regexp(pattern, options);
+    // JIT-compile now rather than after the first few matches
+    regexp.optimize();
+    cache->insert(pattern, new QRegularExpression(regexp));
+    return regexp;
+}
+
+// SQLite may run the destructor right away, so this comes last and the
+// pattern is not used after it.
+static void qKeepRegexp(sqlite3_context *context, int arg, const QRegularExpression &regexp)
+{
+    sqlite3_set_auxdata(context, arg, new QRegularExpression(regexp), [](void *regexp) { delete static_cast<QRegularExpression *>(regexp); });
+}
+
+static QRegularExpressionMatch qMatch(const QRegularExpression &regexp, QStringView subject)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
+    return regexp.matchView(subject);
+#else
+    return regexp.match(subject);
+#endif
+}
+
+// X REGEXP Y calls regexp(Y, X)
 static void _q_regexp(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
     if (Q_UNLIKELY(argc != 2))
@@ -618,93 +1593,643 @@ static void _q_regexp(sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
 
-    const QString pattern = QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_value_text(argv[0])));
-    const QString subject = QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_value_text(argv[1])));
-
-    auto cache = static_cast<QCache<QString, QRegularExpression> *>(sqlite3_user_data(context));
-    auto regexp = cache->object(pattern);
-    const bool wasCached = regexp;
+    bool fromAuxdata;
+    const QRegularExpression regexp = qRegexpArgument(context, argv, 0, QRegularExpression::DontCaptureOption, &fromAuxdata);
+    const bool found = qMatch(regexp, qTextArgument(argv[1])).hasMatch();
+    sqlite3_result_int(context, int(found));
+    if (!fromAuxdata)
+        qKeepRegexp(context, 0, regexp);
+}
 
-    if (!wasCached)
-        regexp = new QRegularExpression(pattern, QRegularExpression::DontCaptureOption);
+// regexp_replace(subject, pattern, replacement), replacement may use \1 ... \99
+static void _q_regexp_replace(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (Q_UNLIKELY(argc != 3) || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    {
+        sqlite3_result_null(context);
+        return;
+    }
 
-    const bool found = subject.contains(*regexp);
+    bool fromAuxdata;
+    const QRegularExpression regexp = qRegexpArgument(context, argv, 1, QRegularExpression::NoPatternOption, &fromAuxdata);
+    if (!regexp.isValid())
+    {
+        sqlite3_result_error(context, regexp.errorString().toUtf8().constData(), -1);
+        return;
+    }
+    QString subject = qTextArgument(argv[0]).toString();
+    subject.replace(regexp, qTextArgument(argv[2]).toString());
+    qResultText(context, subject);
+    if (!fromAuxdata)
+        qKeepRegexp(context, 1, regexp);
+}
 
-    if (!wasCached)
-        cache->insert(pattern, regexp);
+// regexp_capture(subject, pattern[, group]), NULL if the pattern does not match
+static void _q_regexp_capture(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (Q_UNLIKELY(argc != 2 && argc != 3) || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    {
+        sqlite3_result_null(context);
+        return;
+    }
 
-    sqlite3_result_int(context, int(found));
+    bool fromAuxdata;
+    const QRegularExpression regexp = qRegexpArgument(context, argv, 1, QRegularExpression::NoPatternOption, &fromAuxdata);
+    if (!regexp.isValid())
+    {
+        sqlite3_result_error(context, regexp.errorString().toUtf8().constData(), -1);
+        return;
+    }
+    const QRegularExpressionMatch match = qMatch(regexp, qTextArgument(argv[0]));
+    const int group = argc == 3 ? sqlite3_value_int(argv[2]) : 0;
+    if (match.hasMatch() && group <= match.lastCapturedIndex() && match.capturedStart(group) >= 0)
+        qResultText(context, match.capturedView(group));
+    else
+        sqlite3_result_null(context);
+    if (!fromAuxdata)
+        qKeepRegexp(context, 1, regexp);
 }
 
 static void _q_regexp_cleanup(void *cache)
 {
     delete static_cast<QCache<QString, QRegularExpression> *>(cache);
 }
-#endif
 
-QSQLCipherDriver::QSQLCipherDriver(QObject *parent) : QSqlDriver(*new QSQLCipherDriverPrivate, parent)
+static void qRegisterRegexpFunction(sqlite3 *access, const char *name, int argc, void (*function)(sqlite3_context *, int, sqlite3_value **), int cacheSize)
 {
+    int flags = SQLITE_UTF16;
+#if (SQLITE_VERSION_NUMBER >= 3008003)
+    // lets SQLite evaluate constant calls once and use them in indexes
+    flags |= SQLITE_DETERMINISTIC;
+#endif
+    // every function gets its own cache, each one is deleted with its function
+    auto cache = new QCache<QString, QRegularExpression>(cacheSize);
+    sqlite3_create_function_v2(access, name, argc, flags, cache, function, nullptr, nullptr, &_q_regexp_cleanup);
 }
+#endif
 
-QSQLCipherDriver::QSQLCipherDriver(sqlite3 *connection, QObject *parent) : QSqlDriver(*new QSQLCipherDriverPrivate, parent)
+// Overwrites key material in a way the compiler is not allowed to optimize away.
+static void qSecureZero(void *data, size_t size)
 {
-    Q_D(QSQLCipherDriver);
-    d->access = connection;
-    setOpen(true);
-    setOpenError(false);
+#if defined Q_OS_WIN
+    SecureZeroMemory(data, size);
+#else
+    volatile char *p = static_cast<volatile char *>(data);
+    while (size--)
+        *p++ = 0;
+#endif
 }
 
-QSQLCipherDriver::~QSQLCipherDriver()
+// Key material pinned in memory so it is never written to swap, wiped on destruction.
+class QSQLCipherSecureBuffer
 {
-    QSQLCipherDriver::close();
+  public:
+    explicit QSQLCipherSecureBuffer(const QByteArray &data) : m_size(size_t(data.size())), m_data(new char[m_size])
+    {
+        memcpy(m_data, data.constData(), m_size);
+#if defined Q_OS_WIN
+        m_locked = VirtualLock(m_data, m_size);
+#else
+        m_locked = mlock(m_data, m_size) == 0;
+#endif
+    }
+    ~QSQLCipherSecureBuffer()
+    {
+        qSecureZero(m_data, m_size);
+        if (m_locked)
+        {
+#if defined Q_OS_WIN
+            VirtualUnlock(m_data, m_size);
+#else
+            munlock(m_data, m_size);
+#endif
+        }
+        delete[] m_data;
+    }
+    Q_DISABLE_COPY_MOVE(QSQLCipherSecureBuffer)
+
+    const char *data() const
+    {
+        return m_data;
+    }
+    qsizetype size() const
+    {
+        return qsizetype(m_size);
+    }
+
+  private:
+    size_t m_size;
+    char *m_data;
+    bool m_locked = false;
+};
+
+// The key given to sqlite3_key() for a password, "x'<password>'" for raw key
+// material. Built in a single buffer the caller wipes, toUtf8() and
+// concatenating would leave copies of the password behind on the heap.
+static QByteArray qKeySpec(const QString &password, bool rawKey)
+{
+    QStringEncoder toUtf8(QStringEncoder::Utf8);
+    QByteArray spec(toUtf8.requiredSpace(password.size()) + 3, Qt::Uninitialized);
+    char *end = spec.data();
+    if (rawKey)
+    {
+        *end++ = 'x';
+        *end++ = '\'';
+    }
+    end = toUtf8.appendToBuffer(end, password);
+    if (rawKey)
+        *end++ = '\'';
+    spec.truncate(end - spec.constData());
+    return spec;
 }
 
-bool QSQLCipherDriver::hasFeature(DriverFeature f) const
+// Appends data hex encoded, spec must have the room reserved
+static void qAppendHex(QByteArray &spec, const char *data, qsizetype size)
 {
-    switch (f)
+    static constexpr char digits[] = "0123456789abcdef";
+    for (qsizetype i = 0; i < size; ++i)
     {
-        case BLOB:
-        case Transactions:
-        case Unicode:
-        case LastInsertId:
-        case PreparedQueries:
-        case PositionalPlaceholders:
-        case SimpleLocking:
-        case FinishQuery:
-        case LowPrecisionNumbers:
-        case EventNotifications: return true;
-        case QuerySize:
-        case BatchOperations:
-        case MultipleResultSets:
-        case CancelQuery: return false;
-        case NamedPlaceholders:
-#if (SQLITE_VERSION_NUMBER < 3003011)
-            return false;
-#else
-            return true;
-#endif
+        spec.append(digits[uchar(data[i]) >> 4]);
+        spec.append(digits[uchar(data[i]) & 0xf]);
     }
-    return false;
 }
 
-/*
-   SQLite dbs have no user name, passwords, hosts or ports.
-   just file names.
-*/
-bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &pass, const QString &, int, const QString &conOpts)
+// The key derivation SQLCipher applies to a passphrase, SQLCipher 4 defaults.
+struct QSQLCipherKdfSettings
 {
-    Q_D(QSQLCipherDriver);
-    if (isOpen())
-        close();
+    QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha512;
+    int iterations = 256000;
+};
 
-    int timeOut = 5000;
-    bool sharedCache = false;
-    bool openReadOnlyOption = false;
-    bool openUriOption = false;
-    bool useExtendedResultCodes = true;
-#if QT_CONFIG(regularexpression)
+// PBKDF2 (RFC 8018), as run by SQLCipher on the passphrase and the file salt.
+static QByteArray qDeriveKeyPbkdf2(const QSQLCipherKdfSettings &kdf, const QByteArray &passphrase, const QByteArray &salt, int keyLength)
+{
+    QByteArray key;
+    QMessageAuthenticationCode hmac(kdf.algorithm, passphrase);
+    for (quint32 block = 1; key.size() < keyLength; ++block)
+    {
+        const quint32 blockIndex = qToBigEndian(block);
+        hmac.reset();
+        hmac.addData(salt);
+        hmac.addData(reinterpret_cast<const char *>(&blockIndex), sizeof(blockIndex));
+        QByteArray u = hmac.result();
+        QByteArray t = u;
+        for (int i = 1; i < kdf.iterations; ++i)
+        {
+            hmac.reset();
+            hmac.addData(u);
+            qSecureZero(u.data(), size_t(u.size()));
+            u = hmac.result();
+            for (qsizetype j = 0; j < t.size(); ++j)
+                t[j] = char(t.at(j) ^ u.at(j));
+        }
+        key.append(t);
+        qSecureZero(u.data(), size_t(u.size()));
+        qSecureZero(t.data(), size_t(t.size()));
+    }
+    key.truncate(keyLength);
+    return key;
+}
+
+// Process-wide cache of derived keys, so only the first connection to a
+// database pays for the key derivation. Entries are keyed by a digest of
+// the KDF settings, the file salt and the passphrase.
+class QSQLCipherKeyCache
+{
+  public:
+    static constexpr int KeyLength = 32;
+    static constexpr int SaltLength = 16;
+
+    QByteArray cacheId(const QSQLCipherKdfSettings &kdf, const QByteArray &salt, const QByteArray &passphrase) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        hash.addData(QByteArray::number(int(kdf.algorithm)) + ':' + QByteArray::number(kdf.iterations) + ':');
+        hash.addData(salt);
+        hash.addData(passphrase);
+        return hash.result();
+    }
+
+    // Returns the raw key spec "x'<key><salt>'", deriving and caching the key on a miss.
+    QByteArray keySpec(const QByteArray &id, const QSQLCipherKdfSettings &kdf, const QByteArray &salt, const QByteArray &passphrase)
+    {
+        std::shared_ptr<QSQLCipherSecureBuffer> key;
+        {
+            QMutexLocker locker(&mutex);
+            key = keys.value(id);
+        }
+
+        if (!key)
+        {
+            // derive outside the lock, other databases must not wait for this one
+            QByteArray derived = qDeriveKeyPbkdf2(kdf, passphrase, salt, KeyLength);
+            key = std::make_shared<QSQLCipherSecureBuffer>(derived);
+            qSecureZero(derived.data(), size_t(derived.size()));
+            QMutexLocker locker(&mutex);
+            keys.insert(id, key);
+        }
+
+        // the buffer never grows, a reallocation would leave a copy of the key
+        QByteArray spec;
+        spec.reserve(3 + 2 * (key->size() + salt.size()));
+        spec.append("x'");
+        qAppendHex(spec, key->data(), key->size());
+        qAppendHex(spec, salt.constData(), salt.size());
+        spec.append('\'');
+        return spec;
+    }
+
+    void remove(const QByteArray &id)
+    {
+        QMutexLocker locker(&mutex);
+        keys.remove(id);
+    }
+
+    void clear()
+    {
+        QMutexLocker locker(&mutex);
+        keys.clear();
+    }
+
+  private:
+    QMutex mutex;
+    QHash<QByteArray, std::shared_ptr<QSQLCipherSecureBuffer>> keys;
+};
+
+Q_GLOBAL_STATIC(QSQLCipherKeyCache, qsqlcipherKeyCache)
+
+// Reads the random salt SQLCipher stores in the first bytes of an encrypted file.
+static QByteArray qReadCipherSalt(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    const QByteArray salt = file.read(QSQLCipherKeyCache::SaltLength);
+    // plain SQLite databases start with the header string instead of a salt
+    if (salt.size() != QSQLCipherKeyCache::SaltLength || salt.startsWith("SQLite format 3"))
+        return QByteArray();
+    return salt;
+}
+
+static bool qIsRawKey(const QString &key)
+{
+    if (key.size() != 2 * QSQLCipherKeyCache::KeyLength && key.size() != 2 * (QSQLCipherKeyCache::KeyLength + QSQLCipherKeyCache::SaltLength))
+        return false;
+    for (const QChar c : key)
+    {
+        const char16_t u = c.unicode();
+        if (!((u >= u'0' && u <= u'9') || (u >= u'a' && u <= u'f') || (u >= u'A' && u <= u'F')))
+            return false;
+    }
+    return true;
+}
+
+static bool qIsKeyword(QStringView value, std::initializer_list<const char *> keywords)
+{
+    for (const char *keyword : keywords)
+    {
+        if (value.compare(QLatin1String(keyword), Qt::CaseInsensitive) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool qIsIntInRange(QStringView value, int minimum, int maximum)
+{
+    bool ok = false;
+    const int n = value.toInt(&ok);
+    return ok && n >= minimum && n <= maximum;
+}
+
+static bool qIsOnOff(QStringView value)
+{
+    return qIsKeyword(value, { "ON", "OFF" });
+}
+
+static bool qIsCipherCompatibility(QStringView value)
+{
+    return qIsIntInRange(value, 1, 4);
+}
+
+static bool qIsCipherPageSize(QStringView value)
+{
+    const int n = value.toInt();
+    return qIsIntInRange(value, 512, 65536) && (n & (n - 1)) == 0;
+}
+
+static bool qIsKdfIter(QStringView value)
+{
+    return qIsIntInRange(value, 1, std::numeric_limits<int>::max());
+}
+
+static bool qIsKdfAlgorithm(QStringView value)
+{
+    return qIsKeyword(value, { "PBKDF2_HMAC_SHA1", "PBKDF2_HMAC_SHA256", "PBKDF2_HMAC_SHA512" });
+}
+
+static bool qIsHmacAlgorithm(QStringView value)
+{
+    return qIsKeyword(value, { "HMAC_SHA1", "HMAC_SHA256", "HMAC_SHA512" });
+}
+
+static bool qIsPlaintextHeaderSize(QStringView value)
+{
+    // the unencrypted part of the header must cover whole cipher blocks
+    return qIsIntInRange(value, 0, 1024) && value.toInt() % 16 == 0;
+}
+
+// A NAME=value connect option that is applied as "PRAGMA pragma = value".
+struct QSQLCipherPragmaOption
+{
+    const char *option;
+    const char *pragma;
+    bool (*isValid)(QStringView value);
+};
+
+// SQLCipher settings, applied right after sqlite3_key() before the first page
+// is read. cipher_compatibility resets all other settings, so it comes first.
+static const QSQLCipherPragmaOption qCipherPragmaOptions[] = {
+    { "QSQLCIPHER_COMPATIBILITY", "cipher_compatibility", qIsCipherCompatibility },
+    { "QSQLCIPHER_PAGE_SIZE", "cipher_page_size", qIsCipherPageSize },
+    { "QSQLCIPHER_KDF_ITER", "kdf_iter", qIsKdfIter },
+    { "QSQLCIPHER_KDF_ALGORITHM", "cipher_kdf_algorithm", qIsKdfAlgorithm },
+    { "QSQLCIPHER_HMAC_ALGORITHM", "cipher_hmac_algorithm", qIsHmacAlgorithm },
+    { "QSQLCIPHER_USE_HMAC", "cipher_use_hmac", qIsOnOff },
+    { "QSQLCIPHER_PLAINTEXT_HEADER_SIZE", "cipher_plaintext_header_size", qIsPlaintextHeaderSize },
+    { "QSQLCIPHER_MEMORY_SECURITY", "cipher_memory_security", qIsOnOff },
+};
+
+static bool qIsInt(QStringView value)
+{
+    bool ok = false;
+    value.toInt(&ok);
+    return ok;
+}
+
+static bool qIsNonNegativeInt(QStringView value)
+{
+    return qIsIntInRange(value, 0, std::numeric_limits<int>::max());
+}
+
+// spill when the cache is full, or only once it holds more than N pages
+static bool qIsCacheSpill(QStringView value)
+{
+    return qIsOnOff(value) || qIsNonNegativeInt(value);
+}
+
+static bool qIsMmapSize(QStringView value)
+{
+    bool ok = false;
+    return value.toLongLong(&ok) >= 0 && ok;
+}
+
+static bool qIsJournalMode(QStringView value)
+{
+    return qIsKeyword(value, { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF" });
+}
+
+static bool qIsSynchronous(QStringView value)
+{
+    return qIsKeyword(value, { "OFF", "NORMAL", "FULL", "EXTRA" });
+}
+
+static bool qIsTempStore(QStringView value)
+{
+    return qIsKeyword(value, { "DEFAULT", "FILE", "MEMORY" });
+}
+
+static bool qIsLockingMode(QStringView value)
+{
+    return qIsKeyword(value, { "NORMAL", "EXCLUSIVE" });
+}
+
+// Performance settings, applied once the key is verified. The locking mode
+// goes before the journal mode, as exclusive locking lets WAL work without
+// shared memory.
+static const QSQLCipherPragmaOption qPerformancePragmaOptions[] = {
+    { "QSQLITE_LOCKING_MODE", "locking_mode", qIsLockingMode },
+    { "QSQLITE_JOURNAL_MODE", "journal_mode", qIsJournalMode },
+    { "QSQLITE_SYNCHRONOUS", "synchronous", qIsSynchronous },
+    { "QSQLITE_CACHE_SIZE", "cache_size", qIsInt },
+    { "QSQLITE_CACHE_SPILL", "cache_spill", qIsCacheSpill },
+    { "QSQLITE_MMAP_SIZE", "mmap_size", qIsMmapSize },
+    { "QSQLITE_TEMP_STORE", "temp_store", qIsTempStore },
+    { "QSQLITE_WAL_AUTOCHECKPOINT", "wal_autocheckpoint", qIsNonNegativeInt },
+};
+
+// Parses a NAME=value option against the given table. Returns false if the
+// option is not in the table; isValid tells whether its value was accepted.
+template<size_t N>
+static bool qParsePragmaOption(const QSQLCipherPragmaOption (&table)[N], QStringView option, QByteArray (&values)[N], bool *isValid)
+{
+    const qsizetype separator = option.indexOf(u'=');
+    const QStringView name = option.left(separator).trimmed();
+    for (size_t i = 0; i < N; ++i)
+    {
+        if (name != QLatin1String(table[i].option))
+            continue;
+        const QStringView value = separator < 0 ? QStringView() : option.mid(separator + 1).trimmed();
+        *isValid = table[i].isValid(value);
+        if (*isValid)
+            values[i] = value.toString().toUpper().toLatin1();
+        return true;
+    }
+    return false;
+}
+
+template<size_t N>
+static QList<QPair<QByteArray, QByteArray>> qPragmaList(const QSQLCipherPragmaOption (&table)[N], const QByteArray (&values)[N])
+{
+    QList<QPair<QByteArray, QByteArray>> pragmas;
+    for (size_t i = 0; i < N; ++i)
+    {
+        if (!values[i].isEmpty())
+            pragmas.append(qMakePair(QByteArray(table[i].pragma), values[i]));
+    }
+    return pragmas;
+}
+
+static QByteArray qPragmaSetting(const QList<QPair<QByteArray, QByteArray>> &pragmas, const char *pragma)
+{
+    for (const auto &entry : pragmas)
+    {
+        if (entry.first == pragma)
+            return entry.second;
+    }
+    return QByteArray();
+}
+
+static int qExecPragmas(sqlite3 *access, const QList<QPair<QByteArray, QByteArray>> &pragmas)
+{
+    for (const auto &pragma : pragmas)
+    {
+        const QByteArray sql = "PRAGMA " + pragma.first + " = " + pragma.second;
+        const int res = sqlite3_exec(access, sql.constData(), nullptr, nullptr, nullptr);
+        if (res != SQLITE_OK)
+            return res;
+    }
+    return SQLITE_OK;
+}
+
+static QVariant qPragmaValue(sqlite3 *access, const char *pragma)
+{
+    QVariant value;
+    sqlite3_stmt *stmt = nullptr;
+    const QByteArray sql = QByteArray("PRAGMA ") + pragma;
+    if (sqlite3_prepare_v2(access, sql.constData(), -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (sqlite3_column_type(stmt, 0) == SQLITE_INTEGER)
+            value = sqlite3_column_int64(stmt, 0);
+        else
+            value = QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static QCryptographicHash::Algorithm qKdfAlgorithm(const QByteArray &name)
+{
+    return name.endsWith("SHA1") ? QCryptographicHash::Sha1 : name.endsWith("SHA256") ? QCryptographicHash::Sha256 : QCryptographicHash::Sha512;
+}
+
+// The key derivation of a connection without cipher settings of its own, as
+// the SQLCipher library in use is configured. Asked every time, since the
+// defaults can be changed at run time. Returns no iterations if unknown.
+static QSQLCipherKdfSettings qDefaultKdfSettings()
+{
+    QSQLCipherKdfSettings kdf;
+    kdf.iterations = 0;
+    sqlite3 *access = nullptr;
+    if (sqlite3_open_v2(":memory:", &access, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, nullptr) == SQLITE_OK)
+    {
+        const QByteArray version = qPragmaValue(access, "cipher_version").toByteArray();
+        const int major = version.left(version.indexOf('.')).toInt();
+        // SQLCipher before 4 has no cipher_default_kdf_algorithm and always uses SHA1
+        const QByteArray algorithm = qPragmaValue(access, "cipher_default_kdf_algorithm").toByteArray();
+        kdf.algorithm = !algorithm.isEmpty() ? qKdfAlgorithm(algorithm) : major < 4 ? QCryptographicHash::Sha1 : QCryptographicHash::Sha512;
+        if (major > 0)
+            kdf.iterations = qPragmaValue(access, "cipher_default_kdf_iter").toInt();
+    }
+    sqlite3_close(access);
+    return kdf;
+}
+
+// The key derivation SQLCipher will run for the given cipher settings.
+static QSQLCipherKdfSettings qKdfSettings(const QList<QPair<QByteArray, QByteArray>> &cipherPragmas)
+{
+    QSQLCipherKdfSettings kdf = qDefaultKdfSettings();
+    for (const auto &pragma : cipherPragmas)
+    {
+        if (pragma.first == "cipher_compatibility")
+        {
+            const int version = pragma.second.toInt();
+            kdf.algorithm = version < 4 ? QCryptographicHash::Sha1 : QCryptographicHash::Sha512;
+            kdf.iterations = version < 3 ? 4000 : version == 3 ? 64000 : 256000;
+        }
+        else if (pragma.first == "kdf_iter")
+        {
+            kdf.iterations = pragma.second.toInt();
+        }
+        else if (pragma.first == "cipher_kdf_algorithm")
+        {
+            kdf.algorithm = qKdfAlgorithm(pragma.second);
+        }
+    }
+    return kdf;
+}
+
+QSQLCipherDriver::QSQLCipherDriver(QObject *parent) : QSqlDriver(*new QSQLCipherDriverPrivate, parent)
+{
+}
+
+QSQLCipherDriver::QSQLCipherDriver(sqlite3 *connection, QObject *parent) : QSqlDriver(*new QSQLCipherDriverPrivate, parent)
+{
+    Q_D(QSQLCipherDriver);
+    d->access = connection;
+    setOpen(true);
+    setOpenError(false);
+}
+
+QSQLCipherDriver::~QSQLCipherDriver()
+{
+    Q_D(QSQLCipherDriver);
+    // a running backup reports back to this object
+    if (d->backupThread)
+    {
+        d->backupAbort = true;
+        d->backupThread->wait();
+        delete d->backupThread;
+    }
+    QSQLCipherDriver::close();
+}
+
+bool QSQLCipherDriver::hasFeature(DriverFeature f) const
+{
+    Q_D(const QSQLCipherDriver);
+    switch (f)
+    {
+        case BLOB:
+        case Transactions:
+        case Unicode:
+        case LastInsertId:
+        case PreparedQueries:
+        case PositionalPlaceholders:
+        case SimpleLocking:
+        case FinishQuery:
+        case LowPrecisionNumbers:
+        case BatchOperations:
+        case CancelQuery:
+        case EventNotifications: return true;
+        case QuerySize: return d->eagerResults;
+        case MultipleResultSets: return false;
+        case NamedPlaceholders:
+#if (SQLITE_VERSION_NUMBER < 3003011)
+            return false;
+#else
+            return true;
+#endif
+    }
+    return false;
+}
+
+/*
+   SQLite dbs have no user name, passwords, hosts or ports.
+   just file names.
+*/
+bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &pass, const QString &, int, const QString &conOpts)
+{
+    Q_D(QSQLCipherDriver);
+    if (isOpen())
+        close();
+
+    int timeOut = 5000;
+    int statementCacheSize = 0;
+    bool sharedCache = false;
+    bool openReadOnlyOption = false;
+    bool openUriOption = false;
+    bool useExtendedResultCodes = true;
+    bool rawKeyOption = false;
+    bool keyCacheOption = false;
+    int lookasideSlotSize = -1;
+    int lookasideSlotCount = -1;
+    qint64 softHeapLimit = -1;
+    qint64 hardHeapLimit = -1;
+    // connect options replace the budgets and the eager mode of an earlier
+    // open() or the setters, they are only applied once the database is open
+    int queryTimeout = conOpts.isEmpty() ? d->queryTimeout : -1;
+    qint64 queryStepLimit = conOpts.isEmpty() ? d->queryStepLimit : -1;
+    bool eagerResults = conOpts.isEmpty() && d->eagerResults;
+    enum class KeyCheck
+    {
+        Full,   // read the whole schema table
+        Header, // decrypt and authenticate page 1 only
+        Lazy    // no check, a wrong key fails the first statement
+    } keyCheck = KeyCheck::Full;
+    QByteArray cipherValues[std::size(qCipherPragmaOptions)];
+    QByteArray performanceValues[std::size(qPerformancePragmaOptions)];
+#if QT_CONFIG(regularexpression)
     static const QString regexpConnectOption = QStringLiteral("QSQLITE_ENABLE_REGEXP");
     bool defineRegexp = false;
+    bool defineRegexpExtensions = false;
     int regexpCacheSize = 25;
 #endif
 
@@ -723,6 +2248,82 @@ bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &p
                     timeOut = nt;
             }
         }
+        else if (option.startsWith(QStringLiteral("QSQLITE_QUERY_TIMEOUT")))
+        {
+            option = option.mid(21).trimmed();
+            if (option.startsWith(u'='))
+            {
+                bool ok;
+                const int msecs = option.mid(1).trimmed().toInt(&ok);
+                if (ok)
+                    queryTimeout = msecs;
+            }
+        }
+        else if (option.startsWith(QStringLiteral("QSQLITE_QUERY_STEP_LIMIT")))
+        {
+            option = option.mid(24).trimmed();
+            if (option.startsWith(u'='))
+            {
+                bool ok;
+                const qint64 steps = option.mid(1).trimmed().toLongLong(&ok);
+                if (ok)
+                    queryStepLimit = steps;
+            }
+        }
+        else if (option.startsWith(QStringLiteral("QSQLITE_STMT_CACHE")))
+        {
+            option = option.mid(18).trimmed();
+            if (option.isEmpty())
+            {
+                statementCacheSize = 64;
+            }
+            else if (option.startsWith(u'='))
+            {
+                bool ok;
+                const int size = option.mid(1).trimmed().toInt(&ok);
+                if (ok && size >= 0)
+                    statementCacheSize = size;
+            }
+        }
+        else if (option.startsWith(QStringLiteral("QSQLITE_LOOKASIDE")))
+        {
+            // QSQLITE_LOOKASIDE=<slot size>,<slot count>
+            const QStringView value = option.mid(17).trimmed();
+            const auto parts = value.startsWith(u'=') ? value.mid(1).split(u',') : QList<QStringView>();
+            bool sizeOk = false;
+            bool countOk = false;
+            if (parts.size() == 2)
+            {
+                lookasideSlotSize = parts.at(0).trimmed().toInt(&sizeOk);
+                lookasideSlotCount = parts.at(1).trimmed().toInt(&countOk);
+            }
+            if (!sizeOk || !countOk || lookasideSlotSize < 0 || lookasideSlotCount < 0)
+            {
+                setLastError(QSqlError(tr("Error opening database"), tr("Invalid value for connect option %1").arg(option), QSqlError::ConnectionError));
+                setOpenError(true);
+                return false;
+            }
+        }
+        else if (option.startsWith(QStringLiteral("QSQLITE_SOFT_HEAP_LIMIT")) || option.startsWith(QStringLiteral("QSQLITE_HARD_HEAP_LIMIT")))
+        {
+            const QStringView value = option.mid(23).trimmed();
+            bool ok = false;
+            const qint64 bytes = value.startsWith(u'=') ? value.mid(1).trimmed().toLongLong(&ok) : -1;
+            if (!ok || bytes < 0)
+            {
+                setLastError(QSqlError(tr("Error opening database"), tr("Invalid value for connect option %1").arg(option), QSqlError::ConnectionError));
+                setOpenError(true);
+                return false;
+            }
+            if (option.startsWith(QStringLiteral("QSQLITE_SOFT")))
+                softHeapLimit = bytes;
+            else
+                hardHeapLimit = bytes;
+        }
+        else if (option == QStringLiteral("QSQLITE_EAGER_RESULTS"))
+        {
+            eagerResults = true;
+        }
         else if (option == QStringLiteral("QSQLITE_OPEN_READONLY"))
         {
             openReadOnlyOption = true;
@@ -739,7 +2340,37 @@ bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &p
         {
             useExtendedResultCodes = false;
         }
+        else if (option == QStringLiteral("QSQLCIPHER_RAW_KEY"))
+        {
+            rawKeyOption = true;
+        }
+        else if (option == QStringLiteral("QSQLCIPHER_KEY_CACHE"))
+        {
+            keyCacheOption = true;
+        }
+        else if (option.startsWith(QStringLiteral("QSQLCIPHER_KEY_CHECK")))
+        {
+            const QStringView value = option.mid(20).trimmed();
+            const QStringView mode = value.startsWith(u'=') ? value.mid(1).trimmed() : QStringView();
+            if (mode == QStringLiteral("FULL"))
+                keyCheck = KeyCheck::Full;
+            else if (mode == QStringLiteral("HEADER"))
+                keyCheck = KeyCheck::Header;
+            else if (mode == QStringLiteral("LAZY"))
+                keyCheck = KeyCheck::Lazy;
+            else
+            {
+                setLastError(QSqlError(tr("Error opening database"), tr("Invalid value for connect option %1").arg(option), QSqlError::ConnectionError));
+                setOpenError(true);
+                return false;
+            }
+        }
 #if QT_CONFIG(regularexpression)
+        else if (option == QStringLiteral("QSQLITE_ENABLE_REGEXP_EXTENSIONS"))
+        {
+            defineRegexp = true;
+            defineRegexpExtensions = true;
+        }
         else if (option.startsWith(regexpConnectOption))
         {
             option = option.mid(regexpConnectOption.size()).trimmed();
@@ -760,7 +2391,19 @@ bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &p
             }
         }
 #endif
+        else if (bool isValid; qParsePragmaOption(qCipherPragmaOptions, option, cipherValues, &isValid) ||
+                               qParsePragmaOption(qPerformancePragmaOptions, option, performanceValues, &isValid))
+        {
+            if (!isValid)
+            {
+                setLastError(QSqlError(tr("Error opening database"), tr("Invalid value for connect option %1").arg(option), QSqlError::ConnectionError));
+                setOpenError(true);
+                return false;
+            }
+        }
     }
+    d->cipherPragmas = qPragmaList(qCipherPragmaOptions, cipherValues);
+    const QList<QPair<QByteArray, QByteArray>> performancePragmas = qPragmaList(qPerformancePragmaOptions, performanceValues);
 
     int openMode = (openReadOnlyOption ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
     openMode |= (sharedCache ? SQLITE_OPEN_SHAREDCACHE : SQLITE_OPEN_PRIVATECACHE);
@@ -769,319 +2412,1616 @@ bool QSQLCipherDriver::open(const QString &db, const QString &, const QString &p
 
     openMode |= SQLITE_OPEN_NOMUTEX;
 
-    const int res = sqlite3_open_v2(db.toUtf8().constData(), &d->access, openMode, nullptr);
+    // the password holds hex key material, optionally followed by the salt
+    if (rawKeyOption && !qIsRawKey(pass))
+    {
+        setLastError(QSqlError(tr("Error opening database"), tr("Invalid raw key"), QSqlError::ConnectionError));
+        setOpenError(true);
+        return false;
+    }
 
-    if (res == SQLITE_OK)
+    // Both are wiped below, the only copy kept is the locked one in d->keySpec
+    QByteArray passphrase = qKeySpec(pass, false);
+    QByteArray keySpec; // empty when it is the passphrase itself
+    QByteArray keyCacheId;
+    if (rawKeyOption)
+    {
+        keySpec = qKeySpec(pass, true);
+    }
+    else if (keyCacheOption && keyCheck != KeyCheck::Lazy && !passphrase.isEmpty() && !openUriOption && db != QStringLiteral(":memory:") &&
+             qPragmaSetting(d->cipherPragmas, "cipher_plaintext_header_size").toInt() == 0)
     {
+        // A key derived with the wrong settings is only noticed by the key
+        // check, without one every statement would fail, hence not with LAZY.
+        // A new database has no salt yet, SQLCipher creates it on the first write.
+        const QByteArray salt = qReadCipherSalt(db);
+        if (!salt.isEmpty())
+        {
+            const QSQLCipherKdfSettings kdf = qKdfSettings(d->cipherPragmas);
+            if (kdf.iterations > 0)
+            {
+                keyCacheId = qsqlcipherKeyCache()->cacheId(kdf, salt, passphrase);
+                keySpec = qsqlcipherKeyCache()->keySpec(keyCacheId, kdf, salt, passphrase);
+            }
+        }
+    }
+
+    const QByteArray fileName = db.toUtf8();
+    bool keyRejected = false;
+    const auto openKeyed = [&](const QByteArray &key) {
+        keyRejected = false;
+        // cancelQuery() reads access from other threads
+        sqlite3 *access = nullptr;
+        int res = sqlite3_open_v2(fileName.constData(), &access, openMode, nullptr);
+        {
+            QMutexLocker locker(&d->interruptMutex);
+            d->access = access;
+        }
+        if (res != SQLITE_OK)
+            return res;
+        // lookaside can only be reconfigured while none of it is in use, and
+        // deriving the key already allocates from it
+        if (lookasideSlotSize >= 0)
+        {
+            res = sqlite3_db_config(d->access, SQLITE_DBCONFIG_LOOKASIDE, nullptr, lookasideSlotSize, lookasideSlotCount);
+            if (res != SQLITE_OK)
+                return res;
+        }
         sqlite3_busy_timeout(d->access, timeOut);
         sqlite3_extended_result_codes(d->access, useExtendedResultCodes);
-        sqlite3_key(d->access, pass.toUtf8().constData(), pass.length());
-        if (sqlite3_exec(d->access, "SELECT count(*) FROM sqlite_master;", NULL, NULL, NULL) == SQLITE_OK)
+        res = sqlite3_key(d->access, key.constData(), int(key.size()));
+        if (res == SQLITE_OK)
+            res = qExecPragmas(d->access, d->cipherPragmas);
+        if (res != SQLITE_OK)
+            return res;
+        switch (keyCheck)
         {
-            setOpen(true);
-            setOpenError(false);
+            case KeyCheck::Full: res = sqlite3_exec(d->access, "SELECT count(*) FROM sqlite_master;", NULL, NULL, NULL); break;
+            // reading the schema cookie makes SQLCipher decrypt and verify the first page
+            case KeyCheck::Header: res = sqlite3_exec(d->access, "PRAGMA schema_version;", NULL, NULL, NULL); break;
+            case KeyCheck::Lazy: break;
+        }
+        keyRejected = res != SQLITE_OK;
+        if (res == SQLITE_OK)
+            res = qExecPragmas(d->access, performancePragmas);
+        return res;
+    };
+
+    int res = openKeyed(keySpec.isEmpty() ? passphrase : keySpec);
+    bool retried = false;
+    if (keyRejected && !keyCacheId.isEmpty())
+    {
+        retried = true;
+        // The file was not created with the KDF settings the key was derived
+        // with, forget that key and let SQLCipher derive it from the passphrase.
+        qsqlcipherKeyCache()->remove(keyCacheId);
+        QMutexLocker locker(&d->interruptMutex);
+        sqlite3_close(d->access);
+        d->access = 0;
+        locker.unlock();
+        res = openKeyed(passphrase);
+    }
+    if (res == SQLITE_OK)
+        d->keySpec = std::make_shared<QSQLCipherSecureBuffer>(retried || keySpec.isEmpty() ? passphrase : keySpec);
+    qSecureZero(keySpec.data(), size_t(keySpec.size()));
+    qSecureZero(passphrase.data(), size_t(passphrase.size()));
+
+    if (res == SQLITE_OK)
+    {
+        // the heap limits apply to the whole process
+        if (softHeapLimit >= 0)
+            sqlite3_soft_heap_limit64(softHeapLimit);
+#if (SQLITE_VERSION_NUMBER >= 3031000)
+        if (hardHeapLimit >= 0)
+            sqlite3_hard_heap_limit64(hardHeapLimit);
+#endif
+        setOpen(true);
+        setOpenError(false);
+        d->statementCache.setMaxCost(statementCacheSize);
+        d->encodingKnown = false;
+        d->databaseName = db;
+        d->connectOptions = conOpts;
+        d->rawKey = rawKeyOption;
+        d->fileDatabase = !openUriOption && !db.isEmpty() && db != QStringLiteral(":memory:");
+        d->readOnly = openReadOnlyOption;
+        d->queryTimeout = queryTimeout;
+        d->queryStepLimit = queryStepLimit;
+        d->eagerResults = eagerResults;
+        d->installTrace();
+        d->installProgressHandler();
 #if QT_CONFIG(regularexpression)
-            if (defineRegexp)
-            {
-                auto cache = new QCache<QString, QRegularExpression>(regexpCacheSize);
-                sqlite3_create_function_v2(d->access, "regexp", 2, SQLITE_UTF8, cache, &_q_regexp, nullptr, nullptr, &_q_regexp_cleanup);
-            }
+        if (defineRegexp)
+            qRegisterRegexpFunction(d->access, "regexp", 2, &_q_regexp, regexpCacheSize);
+        if (defineRegexpExtensions)
+        {
+            qRegisterRegexpFunction(d->access, "regexp_replace", 3, &_q_regexp_replace, regexpCacheSize);
+            qRegisterRegexpFunction(d->access, "regexp_capture", -1, &_q_regexp_capture, regexpCacheSize);
+        }
 #endif
-            return true;
+        return true;
+    }
+
+    setLastError(qMakeError(d->access, keyRejected ? tr("Incorrect Password") : tr("Error opening database"), QSqlError::ConnectionError, res));
+    setOpenError(true);
+
+    if (d->access)
+    {
+        QMutexLocker locker(&d->interruptMutex);
+        sqlite3_close(d->access);
+        d->access = 0;
+    }
+
+    return false;
+}
+
+void QSQLCipherDriver::close()
+{
+    Q_D(QSQLCipherDriver);
+    if (isOpen())
+    {
+        // the backup reads through this connection
+        abortRekey();
+
+        for (QSQLCipherResult *result : qAsConst(d->results))
+            result->d_func()->finalize();
+
+        // cached statements must be finalized before sqlite3_close() can succeed
+        d->statementCache.clear();
+        d->statementCache.setMaxCost(0);
+        d->clearCatalog();
+        d->tracedRows.clear();
+        // and so must blob handles, closing one removes it from the list
+        const QList<QSQLCipherBlob *> blobs = d->blobs;
+        for (QSQLCipherBlob *blob : blobs)
+            blob->close();
+
+        if (d->access && (d->notificationid.count() > 0 || d->changeCapture))
+        {
+            d->notificationid.clear();
+            d->subscribedTables.clear();
+            d->pendingChanges.clear();
+            d->stagedChanges.clear();
+            d->changeCapture = false;
+            d->pendingCapture.clear();
+            d->stagedCapture.clear();
+            d->commitStaged = false;
+            d->installHooks();
         }
-        else
+        d->savepoints.clear();
+
+        d->keySpec.reset();
+
+        QMutexLocker locker(&d->interruptMutex);
+        const int res = sqlite3_close(d->access);
+
+        if (res != SQLITE_OK)
+            setLastError(qMakeError(d->access, tr("Error closing database"), QSqlError::ConnectionError, res));
+        d->access = 0;
+        locker.unlock();
+        setOpen(false);
+        setOpenError(false);
+    }
+}
+
+bool QSQLCipherDriver::cancelQuery()
+{
+    Q_D(QSQLCipherDriver);
+    QMutexLocker locker(&d->interruptMutex);
+    if (!d->access)
+        return false;
+    sqlite3_interrupt(d->access);
+    return true;
+}
+
+// Called every ProgressInterval VM instructions while a statement runs,
+// returning non-zero interrupts it.
+static constexpr int ProgressInterval = 500;
+
+static int qProgressCallback(void *context)
+{
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(context);
+    QSQLCipherQueryBudget *budget = d->runningBudget;
+    if (!budget)
+        return 0;
+    budget->steps += ProgressInterval;
+    if ((d->queryStepLimit >= 0 && budget->steps > d->queryStepLimit) ||
+        (d->queryTimeout >= 0 && budget->nsecs + budget->timer.nsecsElapsed() > qint64(d->queryTimeout) * 1000000))
+    {
+        budget->exceeded = true;
+        return 1;
+    }
+    return 0;
+}
+
+void QSQLCipherDriverPrivate::installProgressHandler()
+{
+    if (!access)
+        return;
+    const bool budgeted = queryTimeout >= 0 || queryStepLimit >= 0;
+    sqlite3_progress_handler(access, budgeted ? ProgressInterval : 0, budgeted ? &qProgressCallback : nullptr, budgeted ? this : nullptr);
+}
+
+// sqlite3_step() for the results. Only the time spent in here counts against
+// the query timeout, not the time the caller takes between rows.
+int QSQLCipherDriverPrivate::step(sqlite3_stmt *stmt, QSQLCipherQueryBudget *budget)
+{
+    const qsizetype captured = pendingCapture.size();
+    if (queryTimeout >= 0)
+        budget->timer.start();
+    // a user defined function may run a query of its own
+    QSQLCipherQueryBudget *outerBudget = std::exchange(runningBudget, budget);
+    const int res = sqlite3_step(stmt);
+    runningBudget = outerBudget;
+    if (queryTimeout >= 0)
+        budget->nsecs += budget->timer.nsecsElapsed();
+    // A failing statement undoes its own changes and leaves the transaction
+    // open, they must not be reported with it. Only ON CONFLICT FAIL keeps the
+    // rows changed before the failing one, they are dropped all the same.
+    if (res == SQLITE_DONE)
+        trackSavepoint(stmt);
+    else if (res != SQLITE_ROW && pendingCapture.size() > captured)
+        pendingCapture.resize(captured);
+    if (!savepoints.isEmpty() && sqlite3_get_autocommit(access))
+        savepoints.clear();
+    settleCommit();
+    return res;
+}
+
+// The first count words of a statement, with quoted names dequoted
+static QList<QByteArray> qLeadingWords(const char *sql, int count)
+{
+    QList<QByteArray> words;
+    const char *p = sql;
+    while (*p && words.size() < count)
+    {
+        if (isspace(uchar(*p)))
+        {
+            ++p;
+        }
+        else if (p[0] == '-' && p[1] == '-')
         {
-            setLastError(qMakeError(d->access, tr("Incorrect Password"), QSqlError::ConnectionError, res));
-            setOpenError(true);
-            if (d->access)
+            while (*p && *p != '\n')
+                ++p;
+        }
+        else if (p[0] == '/' && p[1] == '*')
+        {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+        }
+        else if (*p == '"' || *p == '`' || *p == '\'' || *p == '[')
+        {
+            const char close = *p == '[' ? ']' : *p;
+            QByteArray word;
+            for (++p; *p; ++p)
             {
-                sqlite3_close(d->access);
-                d->access = 0;
+                if (*p == close)
+                {
+                    // a doubled quote stands for itself
+                    if (close == ']' || p[1] != close)
+                        break;
+                    ++p;
+                }
+                word += *p;
             }
-            return false;
+            if (*p)
+                ++p;
+            words.append(word);
+        }
+        else
+        {
+            const char *start = p;
+            while (*p && (isalnum(uchar(*p)) || *p == '_' || *p == '$' || uchar(*p) >= 0x80))
+                ++p;
+            if (p == start)
+                break;
+            words.append(QByteArray(start, int(p - start)));
+        }
+    }
+    return words;
+}
+
+// Follows SAVEPOINT, RELEASE and ROLLBACK TO so the changes undone by a
+// ROLLBACK TO are not reported when the transaction commits. The stack is
+// emptied once the transaction ends, see step().
+void QSQLCipherDriverPrivate::trackSavepoint(sqlite3_stmt *stmt)
+{
+    const char *sql = sqlite3_sql(stmt);
+    while (sql && isspace(uchar(*sql)))
+        ++sql;
+    // most statements are done with after the first letter
+    const char first = sql ? char(*sql | 0x20) : '\0';
+    if (first != 's' && first != 'r')
+        return;
+
+    QList<QByteArray> words = qLeadingWords(sql, 5);
+    const auto is = [&words](int i, const char *keyword) { return words.size() > i && qstricmp(words.at(i).constData(), keyword) == 0; };
+    const auto find = [this](const QByteArray &name) {
+        for (qsizetype i = savepoints.size() - 1; i >= 0; --i)
+        {
+            if (qstricmp(savepoints.at(i).first.constData(), name.constData()) == 0)
+                return i;
         }
+        return qsizetype(-1);
+    };
+
+    if (is(0, "SAVEPOINT") && words.size() > 1)
+    {
+        savepoints.append(qMakePair(words.at(1), pendingCapture.size()));
+    }
+    else if (is(0, "RELEASE"))
+    {
+        if (is(1, "SAVEPOINT"))
+            words.removeAt(1);
+        const qsizetype i = words.size() > 1 ? find(words.at(1)) : -1;
+        if (i >= 0)
+            savepoints.resize(i);
+    }
+    else if (is(0, "ROLLBACK"))
+    {
+        if (is(1, "TRANSACTION"))
+            words.removeAt(1);
+        if (!is(1, "TO"))
+            return;
+        if (is(2, "SAVEPOINT"))
+            words.removeAt(2);
+        const qsizetype i = words.size() > 2 ? find(words.at(2)) : -1;
+        if (i < 0)
+            return;
+        // the savepoint itself stays open
+        savepoints.resize(i + 1);
+        if (pendingCapture.size() > savepoints.at(i).second)
+            pendingCapture.resize(savepoints.at(i).second);
+    }
+}
+
+QSqlError QSQLCipherDriverPrivate::interruptError(const QSQLCipherQueryBudget &budget) const
+{
+    const QString description = budget.exceeded ? QSQLCipherDriver::tr("Query exceeded its time or step budget") : QSQLCipherDriver::tr("Query cancelled");
+    return QSqlError(QObject::tr("QSQLiteResult", "Query interrupted"), description, QSqlError::StatementError, QString::number(SQLITE_INTERRUPT));
+}
+
+void QSQLCipherDriver::setQueryTimeout(int msecs)
+{
+    Q_D(QSQLCipherDriver);
+    d->queryTimeout = msecs;
+    d->installProgressHandler();
+}
+
+int QSQLCipherDriver::queryTimeout() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->queryTimeout;
+}
+
+void QSQLCipherDriver::setQueryStepLimit(qint64 steps)
+{
+    Q_D(QSQLCipherDriver);
+    d->queryStepLimit = steps;
+    d->installProgressHandler();
+}
+
+qint64 QSQLCipherDriver::queryStepLimit() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->queryStepLimit;
+}
+
+QSqlResult *QSQLCipherDriver::createResult() const
+{
+    return new QSQLCipherResult(this);
+}
+
+bool QSQLCipherDriver::beginTransaction()
+{
+    if (!isOpen() || isOpenError())
+        return false;
+
+    QSqlQuery q(createResult());
+    if (!q.exec(QStringLiteral("BEGIN")))
+    {
+        setLastError(QSqlError(tr("Unable to begin transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
+        return false;
+    }
+
+    return true;
+}
+
+bool QSQLCipherDriver::commitTransaction()
+{
+    if (!isOpen() || isOpenError())
+        return false;
+
+    QSqlQuery q(createResult());
+    if (!q.exec(QStringLiteral("COMMIT")))
+    {
+        setLastError(QSqlError(tr("Unable to commit transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
+        return false;
+    }
+
+    return true;
+}
+
+bool QSQLCipherDriver::rollbackTransaction()
+{
+    if (!isOpen() || isOpenError())
+        return false;
+
+    QSqlQuery q(createResult());
+    if (!q.exec(QStringLiteral("ROLLBACK")))
+    {
+        setLastError(QSqlError(tr("Unable to rollback transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
+        return false;
     }
+
+    return true;
+}
+
+QStringList QSQLCipherDriver::tables(QSql::TableType type) const
+{
+    QStringList res;
+    if (!isOpen())
+        return res;
+
+    auto d = const_cast<QSQLCipherDriverPrivate *>(d_func());
+    d->validateCatalog();
+    const auto cached = d->tableLists.constFind(int(type));
+    if (cached != d->tableLists.cend())
+        return *cached;
+
+    QSqlQuery q(createResult());
+    q.setForwardOnly(true);
+
+    QString sql = QStringLiteral("SELECT name FROM sqlite_master WHERE %1 "
+                                 "UNION ALL SELECT name FROM sqlite_temp_master WHERE %1");
+    if ((type & QSql::Tables) && (type & QSql::Views))
+        sql = sql.arg(QStringLiteral("type='table' OR type='view'"));
+    else if (type & QSql::Tables)
+        sql = sql.arg(QStringLiteral("type='table'"));
+    else if (type & QSql::Views)
+        sql = sql.arg(QStringLiteral("type='view'"));
     else
+        sql.clear();
+
+    if (!sql.isEmpty() && q.exec(sql))
+    {
+        while (q.next())
+            res.append(q.value(0).toString());
+    }
+
+    if (type & QSql::SystemTables)
+    {
+        // there are no internal tables beside this one:
+        res.append(QStringLiteral("sqlite_master"));
+    }
+
+    if (!q.lastError().isValid())
+        d->tableLists.insert(int(type), res);
+    return res;
+}
+
+// Splits "schema.table" into "schema." and "table"
+static void qSplitTableName(const QString &tableName, QString &schema, QString &table)
+{
+    table = tableName;
+    const int indexOfSeparator = tableName.indexOf(u'.');
+    if (indexOfSeparator > -1)
+    {
+        const int indexOfCloseBracket = tableName.indexOf(u']');
+        if (indexOfCloseBracket != tableName.size() - 1)
+        {
+            // Handles a case like databaseName.tableName
+            schema = tableName.left(indexOfSeparator + 1);
+            table = tableName.mid(indexOfSeparator + 1);
+        }
+        else
+        {
+            const int indexOfOpenBracket = tableName.lastIndexOf(u'[', indexOfCloseBracket);
+            if (indexOfOpenBracket > 0)
+            {
+                // Handles a case like databaseName.[tableName]
+                schema = tableName.left(indexOfOpenBracket);
+                table = tableName.mid(indexOfOpenBracket);
+            }
+        }
+    }
+}
+
+// Loads the columns, indexes and foreign keys of a table in one go
+static QSQLCipherTableInfo qGetTableInfo(QSqlQuery &q, const QString &tableName)
+{
+    QString schema;
+    QString table;
+    qSplitTableName(tableName, schema, table);
+    const QString escapedTable = _q_escapeIdentifier(table, QSqlDriver::TableName);
+
+    QSQLCipherTableInfo info;
+#if (SQLITE_VERSION_NUMBER >= 3026000)
+    // table_xinfo also lists generated columns, hidden virtual table columns are skipped below
+    q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("table_xinfo (") + escapedTable + u')');
+#else
+    q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("table_info (") + escapedTable + u')');
+#endif
+    while (q.next())
+    {
+        const int hidden = q.record().count() > 6 ? q.value(6).toInt() : 0;
+        if (hidden == 1)
+            continue;
+        bool isPk = q.value(5).toInt();
+        QString typeName = q.value(2).toString().toLower();
+        QString defVal = q.value(4).toString();
+        if (!defVal.isEmpty() && defVal.at(0) == u'\'')
+        {
+            const int end = defVal.lastIndexOf(u'\'');
+            if (end > 0)
+                defVal = defVal.mid(1, end - 1);
+        }
+
+        QSqlField fld(q.value(1).toString(), QMetaType(qGetColumnType(typeName)), tableName);
+        if (isPk && (typeName == QStringLiteral("integer")))
+            // INTEGER PRIMARY KEY fields are auto-generated in sqlite
+            // INT PRIMARY KEY is not the same as INTEGER PRIMARY KEY!
+            fld.setAutoValue(true);
+        fld.setRequired(q.value(3).toInt() != 0);
+        fld.setDefaultValue(defVal);
+        if (hidden == 2 || hidden == 3)
+        {
+            // generated columns cannot be written to, but they are still
+            // selected, setGenerated(false) would drop them from SELECTs too
+            fld.setReadOnly(true);
+        }
+        info.record.append(fld);
+        if (isPk)
+            info.primaryIndex.append(fld);
+    }
+
+    QStringList indexNames;
+    q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("index_list (") + escapedTable + u')');
+    while (q.next())
+        indexNames.append(q.value(1).toString());
+    for (const QString &indexName : qAsConst(indexNames))
+    {
+        QSqlIndex index(tableName, indexName);
+        // key columns only, with expression columns (no name) left out
+        q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("index_xinfo (") + _q_escapeIdentifier(indexName, QSqlDriver::TableName) + u')');
+        while (q.next())
+        {
+            if (!q.value(5).toInt() || q.isNull(2))
+                continue;
+            const int i = info.record.indexOf(q.value(2).toString());
+            if (i < 0)
+                continue;
+            index.append(info.record.field(i), q.value(3).toInt() != 0);
+        }
+        info.indexes.append(index);
+    }
+
+    q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("foreign_key_list (") + escapedTable + u')');
+    int currentId = -1;
+    while (q.next())
+    {
+        // one row per column, grouped by constraint id
+        if (q.value(0).toInt() != currentId)
+        {
+            currentId = q.value(0).toInt();
+            QSQLCipherForeignKey key;
+            key.referencedTable = q.value(2).toString();
+            key.onUpdate = q.value(5).toString();
+            key.onDelete = q.value(6).toString();
+            info.foreignKeys.append(key);
+        }
+        info.foreignKeys.last().columns.append(q.value(3).toString());
+        info.foreignKeys.last().referencedColumns.append(q.value(4).toString());
+    }
+    return info;
+}
+
+// Schema qualified names are looked up every time, only the main and temp
+// schema versions are tracked.
+static QSQLCipherTableInfo qTableInfo(const QSQLCipherDriver *driver, QSQLCipherDriverPrivate *d, const QString &tblname)
+{
+    QString table = tblname;
+    if (driver->isIdentifierEscaped(table, QSqlDriver::TableName))
+        table = driver->stripDelimiters(table, QSqlDriver::TableName);
+
+    d->validateCatalog();
+    const auto cached = d->tableInfo.constFind(table);
+    if (cached != d->tableInfo.cend())
+        return *cached;
+
+    QSqlQuery q(driver->createResult());
+    q.setForwardOnly(true);
+    const QSQLCipherTableInfo info = qGetTableInfo(q, table);
+    if (!table.contains(u'.') && !info.record.isEmpty())
+        d->tableInfo.insert(table, info);
+    return info;
+}
+
+QSqlIndex QSQLCipherDriver::primaryIndex(const QString &tblname) const
+{
+    if (!isOpen())
+        return QSqlIndex();
+    return qTableInfo(this, const_cast<QSQLCipherDriverPrivate *>(d_func()), tblname).primaryIndex;
+}
+
+QSqlRecord QSQLCipherDriver::record(const QString &tbl) const
+{
+    if (!isOpen())
+        return QSqlRecord();
+    return qTableInfo(this, const_cast<QSQLCipherDriverPrivate *>(d_func()), tbl).record;
+}
+
+QList<QSqlIndex> QSQLCipherDriver::indexes(const QString &table) const
+{
+    if (!isOpen())
+        return QList<QSqlIndex>();
+    return qTableInfo(this, const_cast<QSQLCipherDriverPrivate *>(d_func()), table).indexes;
+}
+
+QList<QSQLCipherForeignKey> QSQLCipherDriver::foreignKeys(const QString &table) const
+{
+    if (!isOpen())
+        return QList<QSQLCipherForeignKey>();
+    return qTableInfo(this, const_cast<QSQLCipherDriverPrivate *>(d_func()), table).foreignKeys;
+}
+
+QVariant QSQLCipherDriver::handle() const
+{
+    Q_D(const QSQLCipherDriver);
+    return QVariant::fromValue(d->access);
+}
+
+QString QSQLCipherDriver::escapeIdentifier(const QString &identifier, IdentifierType type) const
+{
+    return _q_escapeIdentifier(identifier, type);
+}
+
+// Runs for every changed row, so it does nothing but a lookup for tables
+// nobody subscribed to.
+static void handle_sqlite_callback(void *qobj, int aoperation, char const *adbname, char const *atablename, sqlite3_int64 arowid)
+{
+    Q_UNUSED(aoperation);
+    Q_UNUSED(adbname);
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(qobj);
+    const QByteArray tableName = QByteArray::fromRawData(atablename, int(qstrlen(atablename)));
+    if (!d->subscribedTables.contains(tableName))
+        return;
+
+    auto it = d->pendingChanges.find(tableName);
+    if (it == d->pendingChanges.end())
+        // fromRawData() only borrows SQLite's string, the key needs its own copy
+        it = d->pendingChanges.insert(QByteArray(atablename), QSet<qint64>());
+    it->insert(arowid);
+}
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+static QVariant qPreupdateValue(sqlite3_value *value)
+{
+    switch (sqlite3_value_type(value))
+    {
+        case SQLITE_INTEGER: return qint64(sqlite3_value_int64(value));
+        case SQLITE_FLOAT: return sqlite3_value_double(value);
+        case SQLITE_BLOB: return QByteArray(static_cast<const char *>(sqlite3_value_blob(value)), sqlite3_value_bytes(value));
+        case SQLITE_NULL: return QVariant();
+        default: return QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_value_text(value)), sqlite3_value_bytes(value));
+    }
+}
+
+static void handle_sqlite_preupdate(void *qobj, sqlite3 *db, int aoperation, char const *adbname, char const *atablename, sqlite3_int64 aoldrowid,
+                                    sqlite3_int64 anewrowid)
+{
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(qobj);
+    QSQLCipherChange change;
+    change.database = QString::fromUtf8(adbname);
+    change.table = QString::fromUtf8(atablename);
+    change.oldRowId = aoldrowid;
+    change.newRowId = anewrowid;
+    switch (aoperation)
+    {
+        case SQLITE_INSERT: change.operation = QSQLCipherChange::Insert; break;
+        case SQLITE_DELETE: change.operation = QSQLCipherChange::Delete; break;
+        default: change.operation = QSQLCipherChange::Update; break;
+    }
+
+    const int columns = sqlite3_preupdate_count(db);
+    sqlite3_value *value = nullptr;
+    if (aoperation != SQLITE_INSERT)
+    {
+        change.oldValues.reserve(columns);
+        for (int i = 0; i < columns; ++i)
+            change.oldValues.append(sqlite3_preupdate_old(db, i, &value) == SQLITE_OK ? qPreupdateValue(value) : QVariant());
+    }
+    if (aoperation != SQLITE_DELETE)
+    {
+        change.newValues.reserve(columns);
+        for (int i = 0; i < columns; ++i)
+            change.newValues.append(sqlite3_preupdate_new(db, i, &value) == SQLITE_OK ? qPreupdateValue(value) : QVariant());
+    }
+    d->pendingCapture.append(std::move(change));
+}
+#endif
+
+static void qMergeChanges(QHash<QByteArray, QSet<qint64>> &into, QHash<QByteArray, QSet<qint64>> &from)
+{
+    if (into.isEmpty())
+    {
+        into.swap(from);
+        return;
+    }
+    for (auto it = from.cbegin(); it != from.cend(); ++it)
+        into[it.key()].unite(it.value());
+    from.clear();
+}
+
+// Runs before the commit is written, which can still fail. The changes are
+// only staged here and published by settleCommit(). Must not touch the
+// connection, a non-zero return would turn the commit into a rollback.
+static int handle_sqlite_commit(void *qobj)
+{
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(qobj);
+    if (d->pendingChanges.isEmpty() && d->pendingCapture.isEmpty())
+        return 0;
+
+    d->stagedCapture.append(std::move(d->pendingCapture));
+    d->pendingCapture.clear();
+    qMergeChanges(d->stagedChanges, d->pendingChanges);
+    d->commitStaged = true;
+    return 0;
+}
+
+// Also runs when a failing commit rolls the transaction back. ROLLBACK TO a
+// savepoint does not get here, see trackSavepoint().
+static void handle_sqlite_rollback(void *qobj)
+{
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(qobj);
+    d->pendingChanges.clear();
+    d->pendingCapture.clear();
+    d->stagedChanges.clear();
+    d->stagedCapture.clear();
+    d->commitStaged = false;
+}
+
+// Called once a statement that may have committed returns. A commit that
+// failed with SQLITE_BUSY leaves the transaction open and its changes go back
+// to it, one that went through is reported.
+void QSQLCipherDriverPrivate::settleCommit()
+{
+    if (!commitStaged)
+        return;
+    commitStaged = false;
+
+    if (!sqlite3_get_autocommit(access))
+    {
+        stagedCapture.append(std::move(pendingCapture));
+        pendingCapture = std::move(stagedCapture);
+        stagedCapture.clear();
+        qMergeChanges(pendingChanges, stagedChanges);
+        return;
+    }
+
+    committedCapture.append(std::move(stagedCapture));
+    stagedCapture.clear();
+    qMergeChanges(committedChanges, stagedChanges);
+    if (!flushScheduled)
+    {
+        flushScheduled = true;
+        QMetaObject::invokeMethod(static_cast<QSQLCipherDriver *>(q_ptr), "flushNotifications", Qt::QueuedConnection);
+    }
+}
+
+// SQLite keeps a single hook of each kind per connection, notifications and
+// change capture share the commit and rollback hooks.
+void QSQLCipherDriverPrivate::installHooks()
+{
+    const bool notify = !notificationid.isEmpty();
+    const bool transactional = notify || changeCapture;
+    sqlite3_update_hook(access, notify ? &handle_sqlite_callback : nullptr, notify ? this : nullptr);
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    sqlite3_preupdate_hook(access, changeCapture ? &handle_sqlite_preupdate : nullptr, changeCapture ? this : nullptr);
+#endif
+    sqlite3_commit_hook(access, transactional ? &handle_sqlite_commit : nullptr, transactional ? this : nullptr);
+    sqlite3_rollback_hook(access, transactional ? &handle_sqlite_rollback : nullptr, transactional ? this : nullptr);
+}
+
+bool QSQLCipherDriver::subscribeToNotification(const QString &name)
+{
+    Q_D(QSQLCipherDriver);
+    if (!isOpen())
+    {
+        qWarning("Database not open.");
+        return false;
+    }
+
+    if (d->notificationid.contains(name))
+    {
+        qWarning("Already subscribing to '%s'.", qPrintable(name));
+        return false;
+    }
+
+    // sqlite supports only one notification callback, so only the first is registered
+    d->notificationid << name;
+    d->subscribedTables.insert(name.toUtf8());
+    if (d->notificationid.count() == 1)
+        d->installHooks();
+
+    return true;
+}
+
+bool QSQLCipherDriver::unsubscribeFromNotification(const QString &name)
+{
+    Q_D(QSQLCipherDriver);
+    if (!isOpen())
+    {
+        qWarning("Database not open.");
+        return false;
+    }
+
+    if (!d->notificationid.contains(name))
+    {
+        qWarning("Not subscribed to '%s'.", qPrintable(name));
+        return false;
+    }
+
+    d->notificationid.removeAll(name);
+    d->subscribedTables.remove(name.toUtf8());
+    d->pendingChanges.remove(name.toUtf8());
+    d->stagedChanges.remove(name.toUtf8());
+    d->committedChanges.remove(name.toUtf8());
+    if (d->notificationid.isEmpty())
+        d->installHooks();
+
+    return true;
+}
+
+bool QSQLCipherDriver::setChangeCaptureEnabled(bool enabled)
+{
+    Q_D(QSQLCipherDriver);
+    if (!isOpen())
+    {
+        qWarning("Database not open.");
+        return false;
+    }
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    if (d->changeCapture == enabled)
+        return true;
+    d->changeCapture = enabled;
+    if (!enabled)
+    {
+        d->pendingCapture.clear();
+        d->stagedCapture.clear();
+        d->committedCapture.clear();
+    }
+    d->installHooks();
+    return true;
+#else
+    if (enabled)
+        qWarning("QSQLCipherDriver: change capture needs SQLITE_ENABLE_PREUPDATE_HOOK.");
+    return !enabled;
+#endif
+}
+
+bool QSQLCipherDriver::isChangeCaptureEnabled() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->changeCapture;
+}
+
+void QSQLCipherDriver::setEagerResultsEnabled(bool enabled)
+{
+    Q_D(QSQLCipherDriver);
+    d->eagerResults = enabled;
+}
+
+bool QSQLCipherDriver::isEagerResultsEnabled() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->eagerResults;
+}
+
+#if (SQLITE_VERSION_NUMBER >= 3020000)
+static int qStatementStatus(sqlite3_stmt *stmt, int counter)
+{
+    // resets the counter for the next run, SQLITE_STMTSTATUS_REPREPARE is never
+    // reset since the column metadata of the statement relies on it
+    return sqlite3_stmt_status(stmt, counter, counter != SQLITE_STMTSTATUS_REPREPARE);
+}
+
+static constexpr qsizetype MaxStatementStats = 1024;
+static constexpr qsizetype MaxPendingTraceEvents = 1024;
+
+// Runs inside sqlite3_step(), so it only records. The signal and the query
+// plans are left to flushTraceEvents().
+static int qTraceCallback(unsigned type, void *context, void *p, void *x)
+{
+    QSQLCipherDriverPrivate *d = static_cast<QSQLCipherDriverPrivate *>(context);
+    if (d->explaining)
+        return 0;
+
+    sqlite3_stmt *stmt = static_cast<sqlite3_stmt *>(p);
+    switch (type)
+    {
+        case SQLITE_TRACE_STMT: d->tracedRows.remove(stmt); break;
+        case SQLITE_TRACE_ROW: ++d->tracedRows[stmt]; break;
+        case SQLITE_TRACE_PROFILE:
+        {
+            QSQLCipherTraceEvent event;
+            const QByteArray sql(sqlite3_sql(stmt));
+            event.sql = QString::fromUtf8(sql);
+            event.elapsedNsecs = *static_cast<const sqlite3_int64 *>(x);
+            if (d->traceOptions & QSQLCipherDriver::TraceRows)
+                event.rows = d->tracedRows.take(stmt);
+            event.fullScanSteps = qStatementStatus(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP);
+            event.sortOperations = qStatementStatus(stmt, SQLITE_STMTSTATUS_SORT);
+            event.autoIndexes = qStatementStatus(stmt, SQLITE_STMTSTATUS_AUTOINDEX);
+            event.vmSteps = qStatementStatus(stmt, SQLITE_STMTSTATUS_VM_STEP);
+            event.reprepares = qStatementStatus(stmt, SQLITE_STMTSTATUS_REPREPARE);
+
+            const QByteArray key = d->statementStats.size() < MaxStatementStats || d->statementStats.contains(sql) ? sql : QByteArray();
+            QSQLCipherStatementStats &stats = d->statementStats[key];
+            ++stats.executions;
+            stats.totalNsecs += event.elapsedNsecs;
+            stats.maxNsecs = qMax(stats.maxNsecs, event.elapsedNsecs);
+            stats.rows += qMax<qint64>(0, event.rows);
+            stats.fullScanSteps += event.fullScanSteps;
+            stats.sortOperations += event.sortOperations;
+            stats.autoIndexes += event.autoIndexes;
+            stats.vmSteps += event.vmSteps;
+            int bucket = 0;
+            for (qint64 usecs = event.elapsedNsecs / 1000; usecs > 0 && bucket < QSQLCipherStatementStats::HistogramBuckets - 1; usecs >>= 1)
+                ++bucket;
+            ++stats.histogram[bucket];
+
+            // without a receiver, or an event loop to flush them, events would pile up
+            if (!d->traceConnected)
+                break;
+            if (d->pendingTraceEvents.size() >= MaxPendingTraceEvents)
+            {
+                ++d->droppedTraceEvents;
+                break;
+            }
+            d->pendingTraceEvents.append(std::move(event));
+            if (!d->traceFlushScheduled)
+            {
+                d->traceFlushScheduled = true;
+                QMetaObject::invokeMethod(static_cast<QSQLCipherDriver *>(d->q_ptr), "flushTraceEvents", Qt::QueuedConnection);
+            }
+            break;
+        }
+    }
+    return 0;
+}
+#endif
+
+void QSQLCipherDriverPrivate::installTrace()
+{
+#if (SQLITE_VERSION_NUMBER >= 3020000)
+    if (!access)
+        return;
+    unsigned mask = 0;
+    if (traceOptions)
+        mask |= SQLITE_TRACE_PROFILE;
+    if (traceOptions & QSQLCipherDriver::TraceRows)
+        mask |= SQLITE_TRACE_STMT | SQLITE_TRACE_ROW;
+    sqlite3_trace_v2(access, mask, mask ? &qTraceCallback : nullptr, mask ? this : nullptr);
+    tracedRows.clear();
+#endif
+}
+
+void QSQLCipherDriver::setTraceOptions(TraceOptions options)
+{
+    Q_D(QSQLCipherDriver);
+#if (SQLITE_VERSION_NUMBER < 3020000)
+    if (options)
+        qWarning("QSQLCipherDriver: tracing needs SQLite 3.20 or later.");
+#endif
+    d->traceOptions = options;
+    d->installTrace();
+}
+
+QSQLCipherDriver::TraceOptions QSQLCipherDriver::traceOptions() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->traceOptions;
+}
+
+void QSQLCipherDriver::setSlowQueryThreshold(int msecs)
+{
+    Q_D(QSQLCipherDriver);
+    d->slowQueryThreshold = msecs;
+}
+
+int QSQLCipherDriver::slowQueryThreshold() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->slowQueryThreshold;
+}
+
+QHash<QString, QSQLCipherStatementStats> QSQLCipherDriver::statementStats() const
+{
+    Q_D(const QSQLCipherDriver);
+    QHash<QString, QSQLCipherStatementStats> stats;
+    stats.reserve(d->statementStats.size());
+    for (auto it = d->statementStats.cbegin(); it != d->statementStats.cend(); ++it)
+        stats.insert(QString::fromUtf8(it.key()), it.value());
+    return stats;
+}
+
+qint64 QSQLCipherDriver::droppedTraceEvents() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->droppedTraceEvents;
+}
+
+void QSQLCipherDriver::resetStatementStats()
+{
+    Q_D(QSQLCipherDriver);
+    d->statementStats.clear();
+    d->droppedTraceEvents = 0;
+}
+
+// connectNotify() and disconnectNotify() may run on any thread
+void QSQLCipherDriver::connectNotify(const QMetaMethod &signal)
+{
+    Q_D(QSQLCipherDriver);
+    if (signal == QMetaMethod::fromSignal(&QSQLCipherDriver::statementTraced))
+        d->traceConnected = true;
+    QSqlDriver::connectNotify(signal);
+}
+
+void QSQLCipherDriver::disconnectNotify(const QMetaMethod &signal)
+{
+    Q_D(QSQLCipherDriver);
+    // an invalid method stands for disconnecting everything
+    if (!signal.isValid() || signal == QMetaMethod::fromSignal(&QSQLCipherDriver::statementTraced))
+        d->traceConnected = isSignalConnected(QMetaMethod::fromSignal(&QSQLCipherDriver::statementTraced));
+    QSqlDriver::disconnectNotify(signal);
+}
+
+// EXPLAIN QUERY PLAN of a statement as an indented tree, parameters are left unbound
+static QString qQueryPlan(sqlite3 *access, const QString &sql)
+{
+    sqlite3_stmt *stmt = nullptr;
+    const QByteArray explain = "EXPLAIN QUERY PLAN " + sql.toUtf8();
+    if (sqlite3_prepare_v2(access, explain.constData(), int(explain.size()), &stmt, nullptr) != SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+        return QString();
+    }
+
+    QHash<int, int> depth; // node id -> indentation
+    QString plan;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const int level = depth.value(sqlite3_column_int(stmt, 1), -1) + 1;
+        depth.insert(sqlite3_column_int(stmt, 0), level);
+        plan += QString(level * 2, u' ') + QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3))) + u'\n';
+    }
+    sqlite3_finalize(stmt);
+    return plan;
+}
+
+void QSQLCipherDriver::flushTraceEvents()
+{
+    Q_D(QSQLCipherDriver);
+    d->traceFlushScheduled = false;
+    const QList<QSQLCipherTraceEvent> events = std::exchange(d->pendingTraceEvents, {});
+    for (QSQLCipherTraceEvent event : events)
+    {
+        if (d->slowQueryThreshold >= 0 && event.elapsedNsecs >= qint64(d->slowQueryThreshold) * 1000000 && d->access)
+        {
+            d->explaining = true;
+            event.queryPlan = qQueryPlan(d->access, event.sql);
+            d->explaining = false;
+        }
+        emit statementTraced(event);
+    }
+}
+
+QVariantMap QSQLCipherDriver::cipherSettings() const
+{
+    Q_D(const QSQLCipherDriver);
+    QVariantMap settings;
+    if (!isOpen())
+        return settings;
+
+    for (const QSQLCipherPragmaOption &option : qCipherPragmaOptions)
     {
-        setLastError(qMakeError(d->access, tr("Error opening database"), QSqlError::ConnectionError, res));
-        setOpenError(true);
+        const QVariant value = qPragmaValue(d->access, option.pragma);
+        if (value.isValid())
+            settings.insert(QString::fromLatin1(option.pragma), value);
+    }
+    return settings;
+}
 
-        if (d->access)
-        {
-            sqlite3_close(d->access);
-            d->access = 0;
-        }
+QVariantMap QSQLCipherDriver::performanceSettings() const
+{
+    Q_D(const QSQLCipherDriver);
+    QVariantMap settings;
+    if (!isOpen())
+        return settings;
 
-        return false;
+    for (const QSQLCipherPragmaOption &option : qPerformancePragmaOptions)
+    {
+        const QVariant value = qPragmaValue(d->access, option.pragma);
+        if (value.isValid())
+            settings.insert(QString::fromLatin1(option.pragma), value);
     }
+    settings.insert(QStringLiteral("busy_timeout"), qPragmaValue(d->access, "busy_timeout"));
+    return settings;
 }
 
-void QSQLCipherDriver::close()
+static qint64 qDbStatus(sqlite3 *access, int op, bool highwater, bool reset)
 {
-    Q_D(QSQLCipherDriver);
+    int current = 0;
+    int highwaterValue = 0;
+    sqlite3_db_status(access, op, &current, &highwaterValue, reset);
+    return highwater ? highwaterValue : current;
+}
+
+static qint64 qStatus(int op, bool highwater, bool reset)
+{
+    sqlite3_int64 current = 0;
+    sqlite3_int64 highwaterValue = 0;
+    sqlite3_status64(op, &current, &highwaterValue, reset);
+    return highwater ? highwaterValue : current;
+}
+
+QSQLCipherMemoryStats QSQLCipherDriver::memoryStats(bool reset) const
+{
+    Q_D(const QSQLCipherDriver);
+    QSQLCipherMemoryStats stats;
     if (isOpen())
     {
-        for (QSQLCipherResult *result : qAsConst(d->results))
-            result->d_func()->finalize();
+        stats.cacheUsed = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_USED, false, false);
+#if (SQLITE_VERSION_NUMBER >= 3022000)
+        stats.cacheUsedShared = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_USED_SHARED, false, false);
+#endif
+        stats.cacheHits = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_HIT, false, reset);
+        stats.cacheMisses = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_MISS, false, reset);
+        stats.cacheWrites = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_WRITE, false, reset);
+#if (SQLITE_VERSION_NUMBER >= 3032000)
+        stats.cacheSpills = qDbStatus(d->access, SQLITE_DBSTATUS_CACHE_SPILL, false, reset);
+#endif
+        stats.schemaUsed = qDbStatus(d->access, SQLITE_DBSTATUS_SCHEMA_USED, false, false);
+        stats.statementUsed = qDbStatus(d->access, SQLITE_DBSTATUS_STMT_USED, false, false);
+        stats.lookasideUsed = qDbStatus(d->access, SQLITE_DBSTATUS_LOOKASIDE_USED, false, false);
+        stats.lookasideUsedHighwater = qDbStatus(d->access, SQLITE_DBSTATUS_LOOKASIDE_USED, true, reset);
+        // the lookaside hit and miss counters are reported as the highwater value
+        stats.lookasideHits = qDbStatus(d->access, SQLITE_DBSTATUS_LOOKASIDE_HIT, true, reset);
+        stats.lookasideMissSize = qDbStatus(d->access, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, true, reset);
+        stats.lookasideMissFull = qDbStatus(d->access, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, true, reset);
+    }
 
-        if (d->access && (d->notificationid.count() > 0))
-        {
-            d->notificationid.clear();
-            sqlite3_update_hook(d->access, nullptr, nullptr);
-        }
+    stats.memoryUsed = qStatus(SQLITE_STATUS_MEMORY_USED, false, false);
+    stats.memoryHighwater = qStatus(SQLITE_STATUS_MEMORY_USED, true, reset);
+    stats.mallocCount = qStatus(SQLITE_STATUS_MALLOC_COUNT, false, false);
+    stats.largestAllocation = qStatus(SQLITE_STATUS_MALLOC_SIZE, true, reset);
+    stats.pageCacheOverflow = qStatus(SQLITE_STATUS_PAGECACHE_OVERFLOW, false, false);
+    stats.softHeapLimit = sqlite3_soft_heap_limit64(-1);
+#if (SQLITE_VERSION_NUMBER >= 3031000)
+    stats.hardHeapLimit = sqlite3_hard_heap_limit64(-1);
+#endif
+    return stats;
+}
 
-        const int res = sqlite3_close(d->access);
+void QSQLCipherDriver::clearKeyCache()
+{
+    qsqlcipherKeyCache()->clear();
+}
 
-        if (res != SQLITE_OK)
-            setLastError(qMakeError(d->access, tr("Error closing database"), QSqlError::ConnectionError, res));
-        d->access = 0;
-        setOpen(false);
-        setOpenError(false);
-    }
+qint64 QSQLCipherDriver::statementCacheHits() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->statementCacheHits;
 }
 
-QSqlResult *QSQLCipherDriver::createResult() const
+qint64 QSQLCipherDriver::statementCacheMisses() const
 {
-    return new QSQLCipherResult(this);
+    Q_D(const QSQLCipherDriver);
+    return d->statementCacheMisses;
 }
 
-bool QSQLCipherDriver::beginTransaction()
+void QSQLCipherDriver::blobOpened(QSQLCipherBlob *blob)
 {
-    if (!isOpen() || isOpenError())
-        return false;
+    Q_D(QSQLCipherDriver);
+    d->blobs.append(blob);
+}
 
-    QSqlQuery q(createResult());
-    if (!q.exec(QStringLiteral("BEGIN")))
-    {
-        setLastError(QSqlError(tr("Unable to begin transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
-        return false;
-    }
+void QSQLCipherDriver::blobClosed(QSQLCipherBlob *blob)
+{
+    Q_D(QSQLCipherDriver);
+    d->blobs.removeOne(blob);
+}
 
-    return true;
+int QSQLCipherDriver::fetchColumns(QSqlQuery &query, int maxRows, QList<QSQLCipherColumnBuffer> &columns)
+{
+    // only forward-only queries stream from the statement, see QSQLCipherResult::exec()
+    auto result = dynamic_cast<QSQLCipherResult *>(const_cast<QSqlResult *>(query.result()));
+    if (!result || maxRows < 0)
+        return -1;
+    return result->fetchColumns(maxRows, columns);
 }
 
-bool QSQLCipherDriver::commitTransaction()
+QStringList QSQLCipherDriver::subscribedToNotifications() const
 {
-    if (!isOpen() || isOpenError())
-        return false;
+    Q_D(const QSQLCipherDriver);
+    return d->notificationid;
+}
 
-    QSqlQuery q(createResult());
-    if (!q.exec(QStringLiteral("COMMIT")))
+// One notification per table and committed transaction (or per several, if
+// they commit before the event loop gets here). The payload is the rowid for
+// a single changed row and a QVariantList of rowids otherwise.
+void QSQLCipherDriver::flushNotifications()
+{
+    Q_D(QSQLCipherDriver);
+    d->flushScheduled = false;
+    const QList<QSQLCipherChange> captured = std::exchange(d->committedCapture, {});
+    if (!captured.isEmpty())
+        emit changesCaptured(captured);
+
+    const QHash<QByteArray, QSet<qint64>> changes = std::exchange(d->committedChanges, {});
+    for (auto it = changes.cbegin(); it != changes.cend(); ++it)
     {
-        setLastError(QSqlError(tr("Unable to commit transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
-        return false;
+        const QString tableName = QString::fromUtf8(it.key());
+        if (!d->notificationid.contains(tableName))
+            continue;
+
+        // always a list, also for a single row, see subscribeToNotification()
+        QVariantList rowids;
+        rowids.reserve(it->size());
+        for (qint64 rowid : *it)
+            rowids.append(rowid);
+        emit notification(tableName, QSqlDriver::UnknownSource, rowids);
     }
+}
 
-    return true;
+static bool qReplaceFile(const QString &source, const QString &target)
+{
+#if defined Q_OS_WIN
+    return MoveFileExW(reinterpret_cast<const wchar_t *>(QDir::toNativeSeparators(source).utf16()),
+                       reinterpret_cast<const wchar_t *>(QDir::toNativeSeparators(target).utf16()), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    // rename() replaces the target atomically
+    return ::rename(QFile::encodeName(source).constData(), QFile::encodeName(target).constData()) == 0;
+#endif
 }
 
-bool QSQLCipherDriver::rollbackTransaction()
+void QSQLCipherDriverPrivate::abortRekey()
 {
-    if (!isOpen() || isOpenError())
+    if (rekeyBackup)
+        sqlite3_backup_finish(std::exchange(rekeyBackup, nullptr));
+    if (rekeyTarget)
+        sqlite3_close(std::exchange(rekeyTarget, nullptr));
+    if (!rekeyFileName.isEmpty())
+    {
+        QFile::remove(rekeyFileName);
+        QFile::remove(rekeyFileName + QStringLiteral("-journal"));
+        rekeyFileName.clear();
+    }
+    qSecureZero(rekeyPassword.data(), size_t(rekeyPassword.size()) * sizeof(QChar));
+    rekeyPassword.clear();
+}
+
+bool QSQLCipherDriver::startRekey(const QString &newPassword, int pagesPerStep)
+{
+    Q_D(QSQLCipherDriver);
+    if (!isOpen() || isRekeying() || !d->fileDatabase || d->readOnly || newPassword.isEmpty() || (d->rawKey && !qIsRawKey(newPassword)))
+    {
+        QString reason;
+        if (!isOpen())
+            reason = tr("Database not open");
+        else if (isRekeying())
+            reason = tr("A rekey is already running");
+        else if (!d->fileDatabase || d->readOnly)
+            reason = tr("Only databases opened read-write from a file name can be rekeyed");
+        else
+            reason = tr("Invalid key");
+        setLastError(QSqlError(tr("Unable to rekey database"), reason, QSqlError::ConnectionError));
         return false;
+    }
 
-    QSqlQuery q(createResult());
-    if (!q.exec(QStringLiteral("ROLLBACK")))
+    d->rekeyFileName = d->databaseName + QStringLiteral(".rekey");
+    QFile::remove(d->rekeyFileName);
+    QFile::remove(d->rekeyFileName + QStringLiteral("-journal"));
+
+    QByteArray keySpec = qKeySpec(newPassword, d->rawKey);
+    const QByteArray fileName = d->rekeyFileName.toUtf8();
+    int res = sqlite3_open_v2(fileName.constData(), &d->rekeyTarget, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE | SQLITE_OPEN_NOMUTEX,
+                              nullptr);
+    if (res == SQLITE_OK)
+        res = sqlite3_key(d->rekeyTarget, keySpec.constData(), int(keySpec.size()));
+    qSecureZero(keySpec.data(), size_t(keySpec.size()));
+    // the same cipher settings keep the page size and reserved bytes of both files equal
+    if (res == SQLITE_OK)
+        res = qExecPragmas(d->rekeyTarget, d->cipherPragmas);
+    if (res == SQLITE_OK)
     {
-        setLastError(QSqlError(tr("Unable to rollback transaction"), q.lastError().databaseText(), QSqlError::TransactionError));
+        d->rekeyBackup = sqlite3_backup_init(d->rekeyTarget, "main", d->access, "main");
+        if (!d->rekeyBackup)
+            res = sqlite3_errcode(d->rekeyTarget);
+    }
+    if (res != SQLITE_OK)
+    {
+        setLastError(qMakeError(d->rekeyTarget, tr("Unable to rekey database"), QSqlError::ConnectionError, res));
+        d->abortRekey();
         return false;
     }
 
+    d->rekeyPassword = newPassword;
+    d->rekeyPagesPerStep = pagesPerStep > 0 ? pagesPerStep : -1;
+    QTimer::singleShot(0, this, &QSQLCipherDriver::rekeyStep);
     return true;
 }
 
-QStringList QSQLCipherDriver::tables(QSql::TableType type) const
+void QSQLCipherDriver::abortRekey()
 {
-    QStringList res;
-    if (!isOpen())
-        return res;
+    Q_D(QSQLCipherDriver);
+    if (!isRekeying())
+        return;
+    d->abortRekey();
+    emit rekeyFinished(false);
+}
 
-    QSqlQuery q(createResult());
-    q.setForwardOnly(true);
+bool QSQLCipherDriver::isRekeying() const
+{
+    Q_D(const QSQLCipherDriver);
+    return d->rekeyTarget != nullptr;
+}
 
-    QString sql = QStringLiteral("SELECT name FROM sqlite_master WHERE %1 "
-                                 "UNION ALL SELECT name FROM sqlite_temp_master WHERE %1");
-    if ((type & QSql::Tables) && (type & QSql::Views))
-        sql = sql.arg(QStringLiteral("type='table' OR type='view'"));
-    else if (type & QSql::Tables)
-        sql = sql.arg(QStringLiteral("type='table'"));
-    else if (type & QSql::Views)
-        sql = sql.arg(QStringLiteral("type='view'"));
-    else
-        sql.clear();
+// Copies one chunk of pages per event loop iteration, so the connection keeps
+// serving queries in between. Writes through this connection are applied to
+// the copy as well, writes from other connections restart it.
+void QSQLCipherDriver::rekeyStep()
+{
+    Q_D(QSQLCipherDriver);
+    if (!d->rekeyBackup)
+        return;
 
-    if (!sql.isEmpty() && q.exec(sql))
+    int res = sqlite3_backup_step(d->rekeyBackup, d->rekeyPagesPerStep);
+    const int pageCount = sqlite3_backup_pagecount(d->rekeyBackup);
+    const int copied = pageCount - sqlite3_backup_remaining(d->rekeyBackup);
+    if (res != SQLITE_OK && res != SQLITE_DONE && res != SQLITE_BUSY && res != SQLITE_LOCKED)
     {
-        while (q.next())
-            res.append(q.value(0).toString());
+        setLastError(qMakeError(d->rekeyTarget, tr("Unable to rekey database"), QSqlError::ConnectionError, res));
+        d->abortRekey();
+        emit rekeyFinished(false);
+        return;
     }
 
-    if (type & QSql::SystemTables)
+    emit rekeyProgress(copied, pageCount);
+    // a slot connected to rekeyProgress() may have aborted it
+    if (!d->rekeyBackup)
+        return;
+    // Swapping the files closes the connection, which would end an open
+    // transaction and finalize the queries and blobs in use. Wait for them,
+    // the next step copies the pages written in the meantime.
+    const bool idle = sqlite3_get_autocommit(d->access) && d->blobs.isEmpty() &&
+                      std::none_of(d->results.cbegin(), d->results.cend(), [](const QSQLCipherResult *result) { return result->isActive(); });
+    if (res == SQLITE_DONE && !idle)
+        res = SQLITE_BUSY;
+    if (res != SQLITE_DONE)
     {
-        // there are no internal tables beside this one:
-        res.append(QStringLiteral("sqlite_master"));
+        // another connection holds a lock, give it some time
+        QTimer::singleShot(res == SQLITE_OK ? 0 : 10, this, &QSQLCipherDriver::rekeyStep);
+        return;
     }
 
-    return res;
-}
-
-static QSqlIndex qGetTableInfo(QSqlQuery &q, const QString &tableName, bool onlyPIndex = false)
-{
-    QString schema;
-    QString table(tableName);
-    const int indexOfSeparator = tableName.indexOf(u'.');
-    if (indexOfSeparator > -1)
+    res = sqlite3_backup_finish(std::exchange(d->rekeyBackup, nullptr));
+    if (res != SQLITE_OK)
     {
-        const int indexOfCloseBracket = tableName.indexOf(u']');
-        if (indexOfCloseBracket != tableName.size() - 1)
-        {
-            // Handles a case like databaseName.tableName
-            schema = tableName.left(indexOfSeparator + 1);
-            table = tableName.mid(indexOfSeparator + 1);
-        }
-        else
-        {
-            const int indexOfOpenBracket = tableName.lastIndexOf(u'[', indexOfCloseBracket);
-            if (indexOfOpenBracket > 0)
-            {
-                // Handles a case like databaseName.[tableName]
-                schema = tableName.left(indexOfOpenBracket);
-                table = tableName.mid(indexOfOpenBracket);
-            }
-        }
+        setLastError(qMakeError(d->rekeyTarget, tr("Unable to rekey database"), QSqlError::ConnectionError, res));
+        d->abortRekey();
+        emit rekeyFinished(false);
+        return;
     }
-    q.exec(QStringLiteral("PRAGMA ") + schema + QStringLiteral("table_info (") + _q_escapeIdentifier(table, QSqlDriver::TableName) + u')');
-    QSqlIndex ind;
-    while (q.next())
+    sqlite3_close(std::exchange(d->rekeyTarget, nullptr));
+
+    const QString fileName = std::exchange(d->rekeyFileName, QString());
+    QString password = std::exchange(d->rekeyPassword, QString());
+    const QString databaseName = d->databaseName;
+    const QString connectOptions = d->connectOptions;
+    const bool rawKey = d->rawKey;
+    const QStringList subscriptions = d->notificationid;
+    const bool changeCapture = d->changeCapture;
+    // sqlite3_key() takes the key spec the old file is open with as it is,
+    // raw ("x'...'") or not, so it opens that file again without the key options
+    const std::shared_ptr<QSQLCipherSecureBuffer> oldKeySpec = d->keySpec;
+
+    // Closing the last connection checkpoints and removes the WAL of the old
+    // file, which must not be left behind for the new one.
+    close();
+    const bool replaced = qReplaceFile(fileName, databaseName);
+    bool ok;
+    if (replaced)
     {
-        bool isPk = q.value(5).toInt();
-        if (onlyPIndex && !isPk)
-            continue;
-        QString typeName = q.value(2).toString().toLower();
-        QString defVal = q.value(4).toString();
-        if (!defVal.isEmpty() && defVal.at(0) == u'\'')
+        ok = open(databaseName, QString(), password, QString(), -1, connectOptions);
+    }
+    else
+    {
+        QFile::remove(fileName);
+        QString oldPassword = QString::fromUtf8(oldKeySpec->data(), oldKeySpec->size());
+        QStringList oldOptions = connectOptions.split(u';');
+        oldOptions.removeIf([](const QString &option) {
+            const QString name = option.trimmed();
+            return name == QStringLiteral("QSQLCIPHER_RAW_KEY") || name == QStringLiteral("QSQLCIPHER_KEY_CACHE");
+        });
+        ok = open(databaseName, QString(), oldPassword, QString(), -1, oldOptions.join(u';'));
+        qSecureZero(oldPassword.data(), size_t(oldPassword.size()) * sizeof(QChar));
+        if (ok)
         {
-            const int end = defVal.lastIndexOf(u'\'');
-            if (end > 0)
-                defVal = defVal.mid(1, end - 1);
+            d->connectOptions = connectOptions;
+            d->rawKey = rawKey;
         }
-
-        QSqlField fld(q.value(1).toString(), QMetaType(qGetColumnType(typeName)), tableName);
-        if (isPk && (typeName == QStringLiteral("integer")))
-            // INTEGER PRIMARY KEY fields are auto-generated in sqlite
-            // INT PRIMARY KEY is not the same as INTEGER PRIMARY KEY!
-            fld.setAutoValue(true);
-        fld.setRequired(q.value(3).toInt() != 0);
-        fld.setDefaultValue(defVal);
-        ind.append(fld);
+        setLastError(QSqlError(tr("Unable to rekey database"), tr("Unable to replace %1").arg(databaseName), QSqlError::ConnectionError));
     }
-    return ind;
-}
-
-QSqlIndex QSQLCipherDriver::primaryIndex(const QString &tblname) const
-{
-    if (!isOpen())
-        return QSqlIndex();
-
-    QString table = tblname;
-    if (isIdentifierEscaped(table, QSqlDriver::TableName))
-        table = stripDelimiters(table, QSqlDriver::TableName);
-
-    QSqlQuery q(createResult());
-    q.setForwardOnly(true);
-    return qGetTableInfo(q, table, true);
-}
-
-QSqlRecord QSQLCipherDriver::record(const QString &tbl) const
-{
-    if (!isOpen())
-        return QSqlRecord();
-
-    QString table = tbl;
-    if (isIdentifierEscaped(table, QSqlDriver::TableName))
-        table = stripDelimiters(table, QSqlDriver::TableName);
+    qSecureZero(password.data(), size_t(password.size()) * sizeof(QChar));
 
-    QSqlQuery q(createResult());
-    q.setForwardOnly(true);
-    return qGetTableInfo(q, table);
+    if (ok)
+    {
+        for (const QString &name : subscriptions)
+            subscribeToNotification(name);
+        if (changeCapture)
+            setChangeCaptureEnabled(true);
+    }
+    emit rekeyFinished(ok && replaced);
 }
 
-QVariant QSQLCipherDriver::handle() const
+// What the backup thread needs, copied so it does not touch the driver
+struct QSQLCipherBackupJob
 {
-    Q_D(const QSQLCipherDriver);
-    return QVariant::fromValue(d->access);
-}
+    QByteArray sourceName;
+    QByteArray targetName;
+    std::shared_ptr<QSQLCipherSecureBuffer> sourceKey;
+    std::shared_ptr<QSQLCipherSecureBuffer> targetKey;
+    QList<QPair<QByteArray, QByteArray>> cipherPragmas;
+    int pagesPerStep;
+    int pauseMsecs;
+};
 
-QString QSQLCipherDriver::escapeIdentifier(const QString &identifier, IdentifierType type) const
+static int qOpenBackupConnection(const QByteArray &fileName, int flags, const QSQLCipherBackupJob &job, const QSQLCipherSecureBuffer &key, sqlite3 **db)
 {
-    return _q_escapeIdentifier(identifier, type);
+    int res = sqlite3_open_v2(fileName.constData(), db, flags | SQLITE_OPEN_PRIVATECACHE | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (res == SQLITE_OK)
+        res = sqlite3_key(*db, key.data(), int(key.size()));
+    if (res == SQLITE_OK)
+        res = qExecPragmas(*db, job.cipherPragmas);
+    return res;
 }
 
-static void handle_sqlite_callback(void *qobj, int aoperation, char const *adbname, char const *atablename, sqlite3_int64 arowid)
+// Runs on the backup thread
+static QSqlError qRunBackup(QSQLCipherDriver *driver, const QSQLCipherBackupJob &job, const std::atomic<bool> &abort)
 {
-    Q_UNUSED(aoperation);
-    Q_UNUSED(adbname);
-    QSQLCipherDriver *driver = static_cast<QSQLCipherDriver *>(qobj);
-    if (driver)
+    sqlite3 *source = nullptr;
+    sqlite3 *target = nullptr;
+    sqlite3 *failed = nullptr; // the connection holding the error message
+    sqlite3_backup *backup = nullptr;
+    bool snapshot = false;
+
+    int res = qOpenBackupConnection(job.sourceName, SQLITE_OPEN_READONLY, job, *job.sourceKey, &source);
+    failed = source;
+    if (res == SQLITE_OK)
     {
-        QMetaObject::invokeMethod(driver, "handleNotification", Qt::QueuedConnection, Q_ARG(QString, QString::fromUtf8(atablename)), Q_ARG(qint64, arowid));
+        sqlite3_busy_timeout(source, 5000);
+        // In WAL mode a read transaction pins one snapshot for the whole copy
+        // without blocking writers, so it never has to start over. In the other
+        // modes it would block them, so the locks are only held during a step and
+        // a write from another connection restarts the copy.
+        snapshot = qPragmaValue(source, "journal_mode").toString() == QStringLiteral("wal");
+        if (snapshot)
+            res = sqlite3_exec(source, "BEGIN; SELECT count(*) FROM sqlite_master;", nullptr, nullptr, nullptr);
     }
-}
-
-bool QSQLCipherDriver::subscribeToNotification(const QString &name)
-{
-    Q_D(QSQLCipherDriver);
-    if (!isOpen())
+    if (res == SQLITE_OK)
     {
-        qWarning("Database not open.");
-        return false;
+        res = qOpenBackupConnection(job.targetName, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, job, *job.targetKey, &target);
+        failed = target;
     }
-
-    if (d->notificationid.contains(name))
+    if (res == SQLITE_OK)
     {
-        qWarning("Already subscribing to '%s'.", qPrintable(name));
-        return false;
+        backup = sqlite3_backup_init(target, "main", source, "main");
+        if (!backup)
+            res = sqlite3_errcode(target);
     }
 
-    // sqlite supports only one notification callback, so only the first is registered
-    d->notificationid << name;
-    if (d->notificationid.count() == 1)
-        sqlite3_update_hook(d->access, &handle_sqlite_callback, reinterpret_cast<void *>(this));
+    while (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED)
+    {
+        if (abort)
+            break;
+        res = sqlite3_backup_step(backup, job.pagesPerStep);
+        const int remaining = sqlite3_backup_remaining(backup);
+        const int pageCount = sqlite3_backup_pagecount(backup);
+        QMetaObject::invokeMethod(
+            driver, [driver, remaining, pageCount] { emit driver->backupProgress(remaining, pageCount); }, Qt::QueuedConnection);
+        if (res != SQLITE_DONE && job.pauseMsecs > 0)
+            QThread::msleep(ulong(job.pauseMsecs));
+    }
 
-    return true;
+    QSqlError error;
+    if (backup)
+    {
+        const int finishRes = sqlite3_backup_finish(backup);
+        if (res == SQLITE_DONE && finishRes != SQLITE_OK)
+            res = finishRes;
+    }
+    if (abort && res != SQLITE_DONE)
+        error = QSqlError(QSQLCipherDriver::tr("Unable to back up database"), QSQLCipherDriver::tr("Backup aborted"), QSqlError::ConnectionError);
+    else if (res != SQLITE_DONE)
+        error = qMakeError(failed, QSQLCipherDriver::tr("Unable to back up database"), QSqlError::ConnectionError, res);
+
+    if (snapshot)
+        sqlite3_exec(source, "COMMIT", nullptr, nullptr, nullptr);
+    sqlite3_close(source);
+    sqlite3_close(target);
+    // a partial copy is no backup
+    if (error.isValid() && target)
+        QFile::remove(QString::fromUtf8(job.targetName));
+    return error;
 }
 
-bool QSQLCipherDriver::unsubscribeFromNotification(const QString &name)
+bool QSQLCipherDriver::startBackup(const QString &fileName, const QString &password, int pagesPerStep, int pauseMsecs)
 {
     Q_D(QSQLCipherDriver);
+    QString reason;
     if (!isOpen())
+        reason = tr("Database not open");
+    else if (d->backupThread)
+        reason = tr("A backup is already running");
+    else if (!d->fileDatabase || !d->keySpec)
+        reason = tr("Only databases opened from a file name can be backed up");
+    else if (fileName.isEmpty() || QFileInfo(fileName).absoluteFilePath() == QFileInfo(d->databaseName).absoluteFilePath())
+        reason = tr("Invalid backup file name");
+    else if (d->rawKey && !password.isEmpty() && !qIsRawKey(password))
+        reason = tr("Invalid key");
+    if (!reason.isEmpty())
     {
-        qWarning("Database not open.");
+        setLastError(QSqlError(tr("Unable to back up database"), reason, QSqlError::ConnectionError));
         return false;
     }
 
-    if (!d->notificationid.contains(name))
+    QSQLCipherBackupJob job;
+    job.sourceName = d->databaseName.toUtf8();
+    job.targetName = fileName.toUtf8();
+    job.sourceKey = d->keySpec;
+    if (password.isEmpty())
     {
-        qWarning("Not subscribed to '%s'.", qPrintable(name));
-        return false;
+        job.targetKey = d->keySpec;
     }
-
-    d->notificationid.removeAll(name);
-    if (d->notificationid.isEmpty())
-        sqlite3_update_hook(d->access, nullptr, nullptr);
-
+    else
+    {
+        QByteArray keySpec = qKeySpec(password, d->rawKey);
+        job.targetKey = std::make_shared<QSQLCipherSecureBuffer>(keySpec);
+        qSecureZero(keySpec.data(), size_t(keySpec.size()));
+    }
+    job.cipherPragmas = d->cipherPragmas;
+    job.pagesPerStep = pagesPerStep > 0 ? pagesPerStep : -1;
+    job.pauseMsecs = pauseMsecs;
+
+    d->backupAbort = false;
+    const std::atomic<bool> *abort = &d->backupAbort;
+    d->backupThread = QThread::create([this, job, abort] {
+        const QSqlError error = qRunBackup(this, job, *abort);
+        QMetaObject::invokeMethod(
+            this,
+            [this, error] {
+                Q_D(QSQLCipherDriver);
+                d->backupThread->wait();
+                delete std::exchange(d->backupThread, nullptr);
+                if (error.isValid())
+                    setLastError(error);
+                emit backupFinished(!error.isValid());
+            },
+            Qt::QueuedConnection);
+    });
+    d->backupThread->start(QThread::LowPriority);
     return true;
 }
 
-QStringList QSQLCipherDriver::subscribedToNotifications() const
+void QSQLCipherDriver::abortBackup()
 {
-    Q_D(const QSQLCipherDriver);
-    return d->notificationid;
+    Q_D(QSQLCipherDriver);
+    d->backupAbort = true;
 }
 
-void QSQLCipherDriver::handleNotification(const QString &tableName, qint64 rowid)
+bool QSQLCipherDriver::isBackingUp() const
 {
     Q_D(const QSQLCipherDriver);
-    if (d->notificationid.contains(tableName))
-        emit notification(tableName, QSqlDriver::UnknownSource, QVariant(rowid));
+    return d->backupThread != nullptr;
 }
@@ -38,23 +38,150 @@
 ****************************************************************************/
 #pragma once
 
+#include <QHash>
 #include <QSqlDriver>
 #include <QSqlDriverCreatorBase>
+#include <QVariant>
 
 #define QT_STATICPLUGIN
 
 struct sqlite3;
 
+class QSqlQuery;
 class QSqlResult;
+class QSQLCipherBlob;
 class QSQLCipherDriverPrivate;
 
+// One result column as filled in by QSQLCipherDriver::fetchColumns().
+// The buffers are cleared but keep their capacity, so reusing the same list
+// across calls does not allocate once it has grown.
+struct QSQLCipherColumnBuffer
+{
+    enum Kind
+    {
+        Integer, // integers, one value per row
+        Real,    // reals, one value per row
+        Text,    // UTF-8 in data, row i spans offsets[i] to offsets[i + 1]
+        Blob     // bytes in data, laid out like Text
+    };
+
+    Kind kind = Text;
+    QByteArray nulls; // bit (i % 8) of byte (i / 8) is set when row i is NULL
+    QList<qint64> integers;
+    QList<double> reals;
+    QList<qint64> offsets;
+    QByteArray data;
+
+    bool isNull(int row) const
+    {
+        return nulls.at(row / 8) & (1 << (row % 8));
+    }
+};
+
+// A row change captured by QSQLCipherDriver::setChangeCaptureEnabled()
+struct QSQLCipherChange
+{
+    enum Operation
+    {
+        Insert,
+        Update,
+        Delete
+    };
+
+    Operation operation = Insert;
+    QString database; // "main", "temp" or the name of an attached database
+    QString table;
+    qint64 oldRowId = 0; // undefined for WITHOUT ROWID tables
+    qint64 newRowId = 0;
+    QVariantList oldValues; // all columns before the change, empty for Insert
+    QVariantList newValues; // all columns after the change, empty for Delete
+};
+
+// A FOREIGN KEY constraint, see QSQLCipherDriver::foreignKeys()
+struct QSQLCipherForeignKey
+{
+    QString referencedTable;
+    QStringList columns;           // in the table the constraint belongs to
+    QStringList referencedColumns; // empty entries refer to the primary key
+    QString onUpdate;
+    QString onDelete;
+};
+
+// Counters of one statement run, reported by QSQLCipherDriver::statementTraced()
+struct QSQLCipherTraceEvent
+{
+    QString sql; // as prepared, without bound values
+    qint64 elapsedNsecs = 0;
+    qint64 rows = -1; // -1 unless QSQLCipherDriver::TraceRows is set
+    qint64 fullScanSteps = 0;
+    qint64 sortOperations = 0;
+    qint64 autoIndexes = 0;
+    qint64 vmSteps = 0;
+    qint64 reprepares = 0;  // over the lifetime of the prepared statement
+    QString queryPlan; // EXPLAIN QUERY PLAN, only for statements above the slow query threshold
+};
+
+// Aggregated over all runs of the same SQL text, as prepared without bound
+// values, see QSQLCipherDriver::statementStats()
+struct QSQLCipherStatementStats
+{
+    static constexpr int HistogramBuckets = 24;
+
+    qint64 executions = 0;
+    qint64 totalNsecs = 0;
+    qint64 maxNsecs = 0;
+    qint64 rows = 0;
+    qint64 fullScanSteps = 0;
+    qint64 sortOperations = 0;
+    qint64 autoIndexes = 0;
+    qint64 vmSteps = 0;
+    // histogram[i] counts runs that took less than 2^i microseconds, the last bucket everything slower
+    qint64 histogram[HistogramBuckets] = {};
+};
+
+// Memory use of a connection and of SQLite in the process, see
+// QSQLCipherDriver::memoryStats(). Sizes are in bytes.
+struct QSQLCipherMemoryStats
+{
+    // this connection, from sqlite3_db_status()
+    qint64 cacheUsed = 0;
+    qint64 cacheUsedShared = 0; // shared caches divided among the connections using them
+    qint64 cacheHits = 0;
+    qint64 cacheMisses = 0;
+    qint64 cacheWrites = 0;
+    qint64 cacheSpills = 0;
+    qint64 schemaUsed = 0;
+    qint64 statementUsed = 0;
+    qint64 lookasideUsed = 0; // slots
+    qint64 lookasideUsedHighwater = 0;
+    qint64 lookasideHits = 0;
+    qint64 lookasideMissSize = 0; // allocations too large for a slot
+    qint64 lookasideMissFull = 0; // allocations while every slot was taken
+    // the whole process, from sqlite3_status64()
+    qint64 memoryUsed = 0;
+    qint64 memoryHighwater = 0;
+    qint64 mallocCount = 0;
+    qint64 largestAllocation = 0;
+    qint64 pageCacheOverflow = 0;
+    qint64 softHeapLimit = 0; // 0 means no limit
+    qint64 hardHeapLimit = 0;
+};
+
 class QSQLCipherDriver : public QSqlDriver
 {
     Q_DECLARE_PRIVATE(QSQLCipherDriver)
     Q_OBJECT
     friend class QSQLCipherResultPrivate;
+    friend class QSQLCipherBlob;
 
   public:
+    enum TraceOption
+    {
+        TraceProfile = 0x1, // time and stmt_status counters of every statement run
+        TraceRows = 0x2     // also count result rows, costs a callback per row
+    };
+    Q_DECLARE_FLAGS(TraceOptions, TraceOption)
+
     explicit QSQLCipherDriver(QObject *parent = nullptr);
     explicit QSQLCipherDriver(sqlite3 *connection, QObject *parent = nullptr);
     ~QSQLCipherDriver();
@@ -62,6 +189,8 @@ class QSQLCipherDriver : public QSqlDriver
     bool open(const QString &db, const QString &user, const QString &password, const QString &host, int port, const QString &connOpts) override;
     void close() override;
     QSqlResult *createResult() const override;
+    // Interrupts the statement running on this connection, may be called from any thread
+    bool cancelQuery() override;
     bool beginTransaction() override;
     bool commitTransaction() override;
     bool rollbackTransaction() override;
@@ -69,13 +198,127 @@ class QSQLCipherDriver : public QSqlDriver
 
     QSqlRecord record(const QString &tablename) const override;
     QSqlIndex primaryIndex(const QString &table) const override;
+    // Table metadata is cached per connection until the schema changes
+    QList<QSqlIndex> indexes(const QString &table) const;
+    QList<QSQLCipherForeignKey> foreignKeys(const QString &table) const;
     QVariant handle() const override;
     QString escapeIdentifier(const QString &identifier, IdentifierType) const override;
 
+    // Emits notification() once per committed transaction, with a QVariantList
+    // of the qint64 rowids changed in the table as payload, also when only one
+    // row changed. It used to be emitted for every row with its qint64 rowid.
     bool subscribeToNotification(const QString &name) override;
     bool unsubscribeFromNotification(const QString &name) override;
     QStringList subscribedToNotifications() const override;
 
+    // Prepared statement cache, enabled with the QSQLITE_STMT_CACHE[=size] connect option
+    qint64 statementCacheHits() const;
+    qint64 statementCacheMisses() const;
+
+    // Effective SQLCipher settings (cipher_page_size, kdf_iter, ...), see the QSQLCIPHER_* connect options
+    QVariantMap cipherSettings() const;
+    // Effective journal_mode, synchronous, cache_size, ... see the QSQLITE_* pragma connect options
+    QVariantMap performanceSettings() const;
+    // Memory is configured with QSQLITE_LOOKASIDE=<slot size>,<slot count>, QSQLITE_CACHE_SIZE,
+    // QSQLITE_CACHE_SPILL and the process wide QSQLITE_SOFT_HEAP_LIMIT and
+    // QSQLITE_HARD_HEAP_LIMIT (bytes). reset restarts the hit, miss and highwater counters.
+    QSQLCipherMemoryStats memoryStats(bool reset = false) const;
+
+    // Reports every row change with its old and new values through
+    // changesCaptured(), batched per committed transaction. Changes undone by a
+    // failing statement or a ROLLBACK TO are left out. Needs SQLite built
+    // with SQLITE_ENABLE_PREUPDATE_HOOK and the driver compiled with it defined.
+    bool setChangeCaptureEnabled(bool enabled);
+    bool isChangeCaptureEnabled() const;
+
+    // Re-encrypts the database with newPassword without taking it offline. The
+    // pages are copied into "<database>.rekey", pagesPerStep at a time from the
+    // event loop while the connection keeps serving queries, then the new file
+    // replaces the old one and the connection is opened again with the same
+    // connect options. The swap waits until no transaction, active query or blob
+    // is open, and other connections to the file must be closed before it. If the
+    // file cannot be replaced the old one is opened again. The password of the
+    // QSqlDatabase is not changed, call QSqlDatabase::setPassword() with
+    // newPassword after rekeyFinished(true) before opening it again. Only for
+    // read-write file databases.
+    bool startRekey(const QString &newPassword, int pagesPerStep = 256);
+    void abortRekey();
+    bool isRekeying() const;
+
+    // Copies the live database to fileName on a background thread with its own
+    // connections, pagesPerStep pages at a time and pausing pauseMsecs between
+    // steps so writers are not held up. The copy is keyed with password, or with
+    // the key of this connection if it is empty, and uses the same cipher
+    // settings. In WAL mode it is a snapshot of when it started, otherwise a
+    // write from another connection makes it start over.
+    bool startBackup(const QString &fileName, const QString &password = QString(), int pagesPerStep = 256, int pauseMsecs = 10);
+    void abortBackup();
+    bool isBackingUp() const;
+
+    // Eager results step through all rows in exec() and reset the statement right
+    // away, so they do not hold a read transaction (and block WAL checkpoints)
+    // while the caller reads them, and size() is known. Applies to queries
+    // executed afterwards, the QSQLITE_EAGER_RESULTS connect option enables it.
+    void setEagerResultsEnabled(bool enabled);
+    bool isEagerResultsEnabled() const;
+
+    // Budgets for every query, from exec() on, -1 for none. Each query counts
+    // its own, and the timeout only the time spent in SQLite, not in the caller
+    // between rows. Statements the driver runs itself are not budgeted. A query
+    // over budget is interrupted and fails with SQLITE_INTERRUPT, like after
+    // cancelQuery(). The QSQLITE_QUERY_TIMEOUT and QSQLITE_QUERY_STEP_LIMIT
+    // connect options set them at open time.
+    void setQueryTimeout(int msecs);
+    int queryTimeout() const;
+    // in SQLite virtual machine instructions, checked every few hundred
+    void setQueryStepLimit(qint64 steps);
+    qint64 queryStepLimit() const;
+
+    // Statement tracing through sqlite3_trace_v2, off by default. Every traced run
+    // is added to statementStats() and reported through statementTraced() from
+    // the event loop, but only while a receiver is connected. Runs beyond 1024
+    // waiting to be reported are dropped and counted by droppedTraceEvents().
+    void setTraceOptions(TraceOptions options);
+    TraceOptions traceOptions() const;
+    // Runs slower than this also get their query plan, -1 disables it
+    void setSlowQueryThreshold(int msecs);
+    int slowQueryThreshold() const;
+    // At most 1024 SQL texts are told apart, runs of any further one are added
+    // up under an empty SQL text
+    QHash<QString, QSQLCipherStatementStats> statementStats() const;
+    qint64 droppedTraceEvents() const;
+    // also resets droppedTraceEvents()
+    void resetStatementStats();
+
+    // Steps up to maxRows rows of an active forward-only, non-eager query into one
+    // buffer per column, the buffer kind follows the column's declared type. Returns
+    // the number of rows fetched, 0 at the end and -1 if the query cannot be read this way.
+    static int fetchColumns(QSqlQuery &query, int maxRows, QList<QSQLCipherColumnBuffer> &columns);
+
+    // Wipes the derived keys cached for the QSQLCIPHER_KEY_CACHE connect option
+    static void clearKeyCache();
+
+  Q_SIGNALS:
+    void changesCaptured(const QList<QSQLCipherChange> &changes);
+    void statementTraced(const QSQLCipherTraceEvent &event);
+    void rekeyProgress(int copiedPages, int pageCount);
+    void rekeyFinished(bool success);
+    void backupProgress(int remainingPages, int pageCount);
+    void backupFinished(bool success);
+
   private Q_SLOTS:
-    void handleNotification(const QString &tableName, qint64 rowid);
+    void flushNotifications();
+    void flushTraceEvents();
+    void rekeyStep();
+
+  protected:
+    void connectNotify(const QMetaMethod &signal) override;
+    void disconnectNotify(const QMetaMethod &signal) override;
+
+  private:
+    // open blob handles keep sqlite3_close() from succeeding, close() closes them first
+    void blobOpened(QSQLCipherBlob *blob);
+    void blobClosed(QSQLCipherBlob *blob);
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(QSQLCipherDriver::TraceOptions)
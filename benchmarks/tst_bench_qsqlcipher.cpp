@@ -0,0 +1,326 @@
+#include "QSQLCipherDriver.hpp"
+
+#include <QSignalSpy>
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include <functional>
+
+// Every benchmark runs once per driver: QSQLCIPHER and the stock QSQLITE
+// driver as the baseline. Run with e.g. "-o results.xml,xml" or "-csv" for
+// machine readable output.
+class tst_QSQLCipherBenchmark : public QObject
+{
+    Q_OBJECT
+
+  private Q_SLOTS:
+    void initTestCase_data();
+    void initTestCase();
+    void init();
+    void cleanup();
+
+    void openAndKey_data();
+    void openAndKey();
+    void insertSingleRow();
+    void selectSingleRow();
+    void insertBatch();
+    void scanForwardOnly();
+    void fetchText();
+    void fetchBlob();
+    void regexpFilter();
+    void notificationThroughput();
+
+  private:
+    QSqlDatabase openDatabase(const QString &connectOptions = QString());
+    void createTable(const QString &definition);
+    void fillTable(const QString &insert, int rows, const std::function<QVariantList(int)> &values);
+
+    QTemporaryDir m_dir;
+    QString m_driver;
+    QString m_fileName;
+    QSqlDatabase m_db;
+};
+
+static const QString Password = QStringLiteral("benchmark");
+static constexpr int ScanRows = 100000;
+static constexpr int FetchRows = 10000;
+static constexpr int BatchRows = 10000;
+
+void tst_QSQLCipherBenchmark::initTestCase_data()
+{
+    QTest::addColumn<QString>("driver");
+    QTest::newRow("QSQLCIPHER") << QStringLiteral("QSQLCIPHER");
+    QTest::newRow("QSQLITE") << QStringLiteral("QSQLITE");
+}
+
+void tst_QSQLCipherBenchmark::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    QSqlDatabase::registerSqlDriver(QStringLiteral("QSQLCIPHER"), new QSqlDriverCreator<QSQLCipherDriver>);
+    if (!QSqlDatabase::isDriverAvailable(QStringLiteral("QSQLITE")))
+        qWarning("QSQLITE is not available, the baseline rows will be skipped.");
+}
+
+void tst_QSQLCipherBenchmark::init()
+{
+    QFETCH_GLOBAL(QString, driver);
+    if (!QSqlDatabase::isDriverAvailable(driver))
+        QSKIP("driver not available");
+
+    static int serial = 0;
+    m_driver = driver;
+    m_fileName = m_dir.filePath(QStringLiteral("bench_%1.db").arg(++serial));
+    m_db = openDatabase(QStringLiteral("QSQLITE_STMT_CACHE"));
+    QVERIFY2(m_db.isOpen(), qPrintable(m_db.lastError().text()));
+}
+
+void tst_QSQLCipherBenchmark::cleanup()
+{
+    const QStringList connections = QSqlDatabase::connectionNames();
+    m_db = QSqlDatabase();
+    for (const QString &connection : connections)
+        QSqlDatabase::removeDatabase(connection);
+    if (!m_fileName.isEmpty())
+        QFile::remove(m_fileName);
+}
+
+QSqlDatabase tst_QSQLCipherBenchmark::openDatabase(const QString &connectOptions)
+{
+    static int serial = 0;
+    QSqlDatabase db = QSqlDatabase::addDatabase(m_driver, QStringLiteral("bench_%1").arg(++serial));
+    db.setDatabaseName(m_fileName);
+    db.setPassword(Password);
+    db.setConnectOptions(connectOptions);
+    db.open();
+    return db;
+}
+
+void tst_QSQLCipherBenchmark::createTable(const QString &definition)
+{
+    QSqlQuery q(m_db);
+    QVERIFY2(q.exec(definition), qPrintable(q.lastError().text()));
+}
+
+void tst_QSQLCipherBenchmark::fillTable(const QString &insert, int rows, const std::function<QVariantList(int)> &values)
+{
+    QVERIFY(m_db.transaction());
+    QSqlQuery q(m_db);
+    QVERIFY(q.prepare(insert));
+    for (int i = 0; i < rows; ++i)
+    {
+        const QVariantList row = values(i);
+        for (int j = 0; j < row.size(); ++j)
+            q.bindValue(j, row.at(j));
+        QVERIFY2(q.exec(), qPrintable(q.lastError().text()));
+    }
+    QVERIFY(m_db.commit());
+}
+
+void tst_QSQLCipherBenchmark::openAndKey_data()
+{
+    QTest::addColumn<QString>("connectOptions");
+    QTest::newRow("derive") << QString();
+    // the first open fills the key cache, the measured ones skip the KDF
+    QTest::newRow("keyCache") << QStringLiteral("QSQLCIPHER_KEY_CACHE");
+}
+
+void tst_QSQLCipherBenchmark::openAndKey()
+{
+    QFETCH(QString, connectOptions);
+    // SQLCipher only writes the salt and the first page with the first
+    // change, without one there is no key to derive or check
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, value INTEGER)"));
+    fillTable(QStringLiteral("INSERT INTO t (value) VALUES (?)"), 100, [](int i) { return QVariantList{ i }; });
+    {
+        QSqlDatabase db = openDatabase(connectOptions);
+        QVERIFY2(db.isOpen(), qPrintable(db.lastError().text()));
+    }
+
+    QBENCHMARK
+    {
+        QSqlDatabase db = openDatabase(connectOptions);
+        QVERIFY(db.isOpen());
+        QSqlQuery q(db);
+        QVERIFY(q.exec(QStringLiteral("SELECT count(*) FROM sqlite_master")));
+        q = QSqlQuery();
+        db.close();
+    }
+}
+
+void tst_QSQLCipherBenchmark::insertSingleRow()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, value INTEGER, name TEXT)"));
+    QSqlQuery q(m_db);
+    int i = 0;
+    QBENCHMARK
+    {
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO t (value, name) VALUES (?, ?)")));
+        q.bindValue(0, ++i);
+        q.bindValue(1, QStringLiteral("row %1").arg(i));
+        QVERIFY(q.exec());
+    }
+}
+
+void tst_QSQLCipherBenchmark::selectSingleRow()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, value INTEGER, name TEXT)"));
+    fillTable(QStringLiteral("INSERT INTO t (id, value, name) VALUES (?, ?, ?)"), FetchRows,
+              [](int i) { return QVariantList{ i, i * 2, QStringLiteral("row %1").arg(i) }; });
+    QSqlQuery q(m_db);
+    q.setForwardOnly(true);
+    int i = 0;
+    QBENCHMARK
+    {
+        QVERIFY(q.prepare(QStringLiteral("SELECT value, name FROM t WHERE id = ?")));
+        q.bindValue(0, i++ % FetchRows);
+        QVERIFY(q.exec());
+        QVERIFY(q.next());
+        QCOMPARE(q.value(0).toInt() % 2, 0);
+    }
+}
+
+void tst_QSQLCipherBenchmark::insertBatch()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, value INTEGER, name TEXT)"));
+    QVariantList values;
+    QVariantList names;
+    for (int i = 0; i < BatchRows; ++i)
+    {
+        values.append(i);
+        names.append(QStringLiteral("row %1").arg(i));
+    }
+
+    QSqlQuery q(m_db);
+    QBENCHMARK
+    {
+        QVERIFY(m_db.transaction());
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO t (value, name) VALUES (?, ?)")));
+        q.addBindValue(values);
+        q.addBindValue(names);
+        QVERIFY2(q.execBatch(), qPrintable(q.lastError().text()));
+        QVERIFY(m_db.commit());
+    }
+}
+
+void tst_QSQLCipherBenchmark::scanForwardOnly()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, a INTEGER, b REAL)"));
+    fillTable(QStringLiteral("INSERT INTO t (a, b) VALUES (?, ?)"), ScanRows, [](int i) { return QVariantList{ i, i * 0.5 }; });
+
+    QBENCHMARK
+    {
+        QSqlQuery q(m_db);
+        q.setForwardOnly(true);
+        QVERIFY(q.exec(QStringLiteral("SELECT id, a, b FROM t")));
+        qint64 sum = 0;
+        int rows = 0;
+        while (q.next())
+        {
+            sum += q.value(1).toLongLong();
+            ++rows;
+        }
+        QCOMPARE(rows, ScanRows);
+        QVERIFY(sum > 0);
+    }
+}
+
+void tst_QSQLCipherBenchmark::fetchText()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, body TEXT)"));
+    const QString body = QStringLiteral("Lorem ipsum dolor sit amet, consectetur adipiscing elit. ").repeated(16);
+    fillTable(QStringLiteral("INSERT INTO t (body) VALUES (?)"), FetchRows, [&body](int i) { return QVariantList{ body + QString::number(i) }; });
+
+    QBENCHMARK
+    {
+        QSqlQuery q(m_db);
+        q.setForwardOnly(true);
+        QVERIFY(q.exec(QStringLiteral("SELECT body FROM t")));
+        qsizetype length = 0;
+        while (q.next())
+            length += q.value(0).toString().size();
+        QVERIFY(length > 0);
+    }
+}
+
+void tst_QSQLCipherBenchmark::fetchBlob()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, data BLOB)"));
+    const QByteArray data(64 * 1024, 'x');
+    fillTable(QStringLiteral("INSERT INTO t (data) VALUES (?)"), FetchRows / 10, [&data](int) { return QVariantList{ data }; });
+
+    QBENCHMARK
+    {
+        QSqlQuery q(m_db);
+        q.setForwardOnly(true);
+        QVERIFY(q.exec(QStringLiteral("SELECT data FROM t")));
+        qsizetype size = 0;
+        while (q.next())
+            size += q.value(0).toByteArray().size();
+        QCOMPARE(size, qsizetype(FetchRows / 10) * data.size());
+    }
+}
+
+void tst_QSQLCipherBenchmark::regexpFilter()
+{
+    m_db.close();
+    m_db.setConnectOptions(QStringLiteral("QSQLITE_STMT_CACHE;QSQLITE_ENABLE_REGEXP"));
+    QVERIFY(m_db.open());
+    createTable(QStringLiteral("CREATE TABLE log (id INTEGER PRIMARY KEY, line TEXT)"));
+    fillTable(QStringLiteral("INSERT INTO log (line) VALUES (?)"), FetchRows, [](int i) {
+        return QVariantList{ QStringLiteral("2024-01-01 12:00:%1 %2 request %3 served in %4ms")
+                                 .arg(i % 60, 2, 10, QLatin1Char('0'))
+                                 .arg(i % 7 ? QStringLiteral("INFO") : QStringLiteral("ERROR"))
+                                 .arg(i)
+                                 .arg(i % 250) };
+    });
+
+    QBENCHMARK
+    {
+        QSqlQuery q(m_db);
+        q.setForwardOnly(true);
+        QVERIFY(q.exec(QStringLiteral("SELECT count(*) FROM log WHERE line REGEXP 'ERROR request \\d+ served in \\d{3}ms'")));
+        QVERIFY(q.next());
+        QVERIFY(q.value(0).toInt() > 0);
+    }
+}
+
+void tst_QSQLCipherBenchmark::notificationThroughput()
+{
+    createTable(QStringLiteral("CREATE TABLE t (id INTEGER PRIMARY KEY, value INTEGER)"));
+    createTable(QStringLiteral("CREATE TABLE other (id INTEGER PRIMARY KEY, value INTEGER)"));
+    QVERIFY(m_db.driver()->subscribeToNotification(QStringLiteral("t")));
+    QSignalSpy spy(m_db.driver(), qOverload<const QString &, QSqlDriver::NotificationSource, const QVariant &>(&QSqlDriver::notification));
+
+    QSqlQuery q(m_db);
+    int i = 0;
+    QBENCHMARK
+    {
+        // a transaction touching a subscribed and an unsubscribed table,
+        // measured until the listener has seen the changes
+        QVERIFY(m_db.transaction());
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO t (value) VALUES (?)")));
+        for (int row = 0; row < 1000; ++row)
+        {
+            q.bindValue(0, ++i);
+            QVERIFY(q.exec());
+        }
+        QVERIFY(q.prepare(QStringLiteral("INSERT INTO other (value) VALUES (?)")));
+        for (int row = 0; row < 1000; ++row)
+        {
+            q.bindValue(0, i);
+            QVERIFY(q.exec());
+        }
+        QVERIFY(m_db.commit());
+        spy.clear();
+        QTRY_VERIFY(!spy.isEmpty());
+        QCoreApplication::processEvents();
+    }
+}
+
+QTEST_GUILESS_MAIN(tst_QSQLCipherBenchmark)
+
+#include "tst_bench_qsqlcipher.moc"